@@ -0,0 +1,670 @@
+/*
+ *      Bench.c - micro benchmarks for C exception handling package
+ *
+ *  DESCRIPTION
+ *      This program measures the time taken by the exception handling macros.
+ *      Each benchmark runs its statement a number of times and the average
+ *      time per run is printed in nanoseconds.
+ *
+ *      On x86 the average number of time stamp counter cycles per run is
+ *      printed too (this counter runs at a constant rate, which may differ
+ *      from the actual clock rate of the core).
+ *
+ *      Without arguments all benchmarks are run.  The first argument selects
+ *      a single benchmark by name, the optional second argument overrides the
+ *      number of runs.  Running a single benchmark is handy for counting the
+ *      system calls it makes, for example:
+ *
+ *              strace -c -e trace=rt_sigprocmask b try 100000
+ *
+ *      With the option -csv or -json (before the other arguments) the results
+ *      are printed as CSV or JSON, for tracking them across builds.  The build
+ *      column/member tells which flags the program was built with.
+ *
+ *      Compare a build with and without EXCEPT_NO_SIGMASK to see the cost of
+ *      saving the signal mask in each setjmp(), and one with EXCEPT_STACK_FRAMES
+ *      to compare pooled with automatic exception handles.  A build with
+ *      EXCEPT_SIGACTION shows what is saved on the outermost 'try' by not
+ *      installing and restoring the signal handlers each time.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#if     defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Except.h"
+#include "Alloc.h"
+#include "Hash.h"
+
+#undef  malloc                  /* Alloc.h wrappers are benchmarked directly */
+#undef  calloc
+#undef  realloc
+
+#define RUNS            1000000 /* default number of runs per benchmark */
+#define HASH_KEYS       4096    /* number of thread IDs in hash benchmarks */
+#define LEGACY_SIZE     256     /* bucket count of legacy chained hash */
+#define DEEP_LEVELS     100000  /* 'try' nesting depth of deep benchmark */
+#define DEEP_STACK      (256 << 20)     /* stack size of deep benchmark */
+#define RETHROW_LEVELS  8       /* catching and rethrowing 'try' levels */
+#define ALLOC_SIZE      64      /* bytes allocated by alloc benchmarks */
+
+typedef enum _Format            /* output format */
+{
+    TEXT,
+    CSV,
+    JSON
+} Format;
+
+typedef struct _Bench           /* benchmark */
+{
+    char *      name;           /* name selecting benchmark */
+    char *      description;    /* what is being measured */
+    void        (*run)(long n); /* performs <n> runs */
+    long        runs;           /* default number of runs */
+} Bench;
+
+static volatile int     sink;   /* defeats optimizing away of user code */
+
+except_class_define(BenchLevel1, Exception);
+except_class_define(BenchLevel2, BenchLevel1);
+except_class_define(BenchLevel3, BenchLevel2);
+except_class_define(BenchLevel4, BenchLevel3);
+except_class_define(BenchLevel5, BenchLevel4);
+
+static except_instance_define(BenchEndOfInput, BenchLevel1, NULL);
+
+
+static void BenchTry(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                sink++;
+            catch (Throwable, e);
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchOuterTry(long n)
+{
+    while (n-- > 0)
+    {
+        try
+            sink++;
+        catch (Throwable, e);
+        finally;
+    }
+}
+
+static void BenchSignal(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                *((volatile int *)0) = 0;
+            catch (SegmentationFault, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchCatch(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                throw (BenchLevel5, NULL);
+            catch (ArithmeticException, e)
+                sink--;
+            catch (SegmentationFault, e)
+                sink--;
+            catch (OutOfMemoryError, e)
+                sink--;
+            catch (FailedAssertion, e)
+                sink--;
+            catch (BusError, e)
+                sink--;
+            catch (BenchLevel1, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchThrow(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                throw (BenchLevel1, NULL);
+            catch (BenchLevel1, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchThrowInstance(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                throw_instance(BenchEndOfInput);
+            catch (BenchLevel1, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+/*
+ * Throws from <levels> nested 'try' statements below the catching one; the
+ * exception is propagated by the 'finally' of each.
+ */
+static void ThrowLevels(int levels)
+{
+    if (levels == 0)
+        throw (BenchLevel1, NULL);
+
+    try
+        ThrowLevels(levels - 1);
+    catch (OutOfMemoryError, e)
+        sink--;
+    finally;
+}
+
+static void BenchThrowDepth(long n, int depth)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                ThrowLevels(depth - 1);
+            catch (BenchLevel1, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchThrow8(long n)  { BenchThrowDepth(n, 8); }
+static void BenchThrow64(long n) { BenchThrowDepth(n, 64); }
+
+/*
+ * Each level catches the exception and rethrows it.
+ */
+static void RethrowLevels(int levels)
+{
+    if (levels == 0)
+        throw (BenchLevel1, NULL);
+
+    try
+        RethrowLevels(levels - 1);
+    catch (BenchLevel1, e)
+        throw (e, NULL);
+    finally;
+}
+
+static void BenchRethrow(long n)
+{
+    try
+    {
+        while (n-- > 0)
+        {
+            try
+                RethrowLevels(RETHROW_LEVELS);
+            catch (BenchLevel1, e)
+                sink++;
+            finally;
+        }
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchAlloc(long n)
+{
+    try
+    {
+        while (n-- > 0)
+            free(AllocMalloc(pC, ALLOC_SIZE, __FILE__, __LINE__));
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void BenchMalloc(long n)
+{
+    while (n-- > 0)
+    {
+        void *  p = malloc(ALLOC_SIZE);
+
+        sink += (p != NULL);
+        free(p);
+    }
+}
+
+static int Return1(void)
+{
+    try
+        return(1);
+    catch (Throwable, e);
+    finally;
+    return 0;
+}
+
+static int Return2(void)
+{
+    try
+        try
+            return(2);
+        catch (Throwable, e);
+        finally;
+    catch (Throwable, e);
+    finally;
+    return 0;
+}
+
+static int Return4(void)
+{
+    try
+        try
+            try
+                try
+                    return(4);
+                catch (Throwable, e);
+                finally;
+            catch (Throwable, e);
+            finally;
+        catch (Throwable, e);
+        finally;
+    catch (Throwable, e);
+    finally;
+    return 0;
+}
+
+static void BenchReturn(long n, int (*routine)(void))
+{
+    try
+    {
+        while (n-- > 0)
+            sink += routine();
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+/*
+ * Replica of the chained hash table that was used for context lookup before
+ * Hash.c switched to open addressing: 256 buckets each holding a List, and a
+ * 16-bit multiplicative hash over the key truncated to int.
+ */
+typedef struct
+{
+    void *      pData;
+    int         key;
+} LegacyNode;
+
+static List *   legacyLists[LEGACY_SIZE];
+
+static int LegacyValue(unsigned key)
+{
+    int         value = (LEGACY_SIZE * ((key * 40503) & 65535)) >> 16;
+
+    return value;
+}
+
+static void LegacyAdd(int key, void *pData)
+{
+    LegacyNode *        pNode = malloc(sizeof(LegacyNode));
+
+    pNode->key   = key;
+    pNode->pData = pData;
+    ListAddHead(legacyLists[LegacyValue(key)], pNode);
+}
+
+static void * LegacyLookup(int key)
+{
+    List *              nodeList = legacyLists[LegacyValue(key)];
+    LegacyNode *        pNode;
+
+    for (pNode = ListHead(nodeList); pNode != NULL; pNode = ListNext(nodeList))
+    {
+        if (pNode->key == key)
+            return pNode->pData;
+    }
+
+    return NULL;
+}
+
+static void * LegacyRemove(int key)
+{
+    List *              nodeList = legacyLists[LegacyValue(key)];
+    LegacyNode *        pNode;
+
+    for (pNode = ListHead(nodeList); pNode != NULL; pNode = ListNext(nodeList))
+    {
+        if (pNode->key == key)
+        {
+            void *      pData = pNode->pData;
+
+            ListRemoveLast(nodeList);
+            free(pNode);
+
+            return pData;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Looks like a pthread_t on Linux: the address of a thread descriptor at the
+ * top of an 8MB stack plus guard page.
+ */
+static uintptr_t ThreadKey(long n)
+{
+    uintptr_t   key = (uintptr_t)0x7f0000000700ull + (uintptr_t)n * 0x801000;
+
+    return key;
+}
+
+static Hash * HashSetup(void)
+{
+    static Hash *       pHash;
+    long                n;
+
+    if (pHash == NULL)
+    {
+        pHash = HashCreate();
+        for (n = 0; n < HASH_KEYS; n++)
+            HashAdd(pHash, ThreadKey(n), (void *)ThreadKey(n));
+    }
+
+    return pHash;
+}
+
+static void LegacySetup(void)
+{
+    long        n;
+
+    if (legacyLists[0] == NULL)
+    {
+        for (n = 0; n < LEGACY_SIZE; n++)
+            legacyLists[n] = ListCreate();
+        for (n = 0; n < HASH_KEYS; n++)
+            LegacyAdd((int)ThreadKey(n), (void *)ThreadKey(n));
+    }
+}
+
+static void BenchHashLookup(long n)
+{
+    Hash *      pHash = HashSetup();
+
+    while (n-- > 0)
+        sink += HashLookup(pHash, ThreadKey(n % HASH_KEYS)) != NULL;
+}
+
+static void BenchLegacyLookup(long n)
+{
+    LegacySetup();
+
+    while (n-- > 0)
+        sink += LegacyLookup((int)ThreadKey(n % HASH_KEYS)) != NULL;
+}
+
+static void BenchHashChurn(long n)
+{
+    Hash *      pHash = HashSetup();
+
+    while (n-- > 0)
+    {
+        uintptr_t       key = ThreadKey(n % HASH_KEYS);
+
+        HashAdd(pHash, key, HashRemove(pHash, key));
+    }
+}
+
+static void BenchLegacyChurn(long n)
+{
+    LegacySetup();
+
+    while (n-- > 0)
+    {
+        int     key = (int)ThreadKey(n % HASH_KEYS);
+
+        LegacyAdd(key, LegacyRemove(key));
+    }
+}
+
+static void BenchReturn1(long n) { BenchReturn(n, Return1); }
+static void BenchReturn2(long n) { BenchReturn(n, Return2); }
+static void BenchReturn4(long n) { BenchReturn(n, Return4); }
+
+static void Deep(int level)
+{
+    try
+    {
+        if (level > 1)
+            Deep(level - 1);
+        else
+            sink++;
+    }
+    catch (Throwable, e);
+    finally;
+}
+
+static void * DeepThread(void *arg)
+{
+    long        n = *(long *)arg;
+
+    while (n-- > 0)
+        Deep(DEEP_LEVELS);
+
+    return NULL;
+}
+
+/*
+ * Runs in a thread of its own to get a stack that is large enough.
+ */
+static void BenchDeep(long n)
+{
+    pthread_attr_t      attr;
+    pthread_t           thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, DEEP_STACK);
+    pthread_create(&thread, &attr, DeepThread, &n);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+static Bench    benches[] =
+{
+    { "try",       "nested try/catch/finally, no throw", BenchTry,      RUNS },
+    { "try_outer", "outermost try/catch/finally",        BenchOuterTry, RUNS },
+    { "signal",    "SIGSEGV caught as exception",        BenchSignal,   RUNS / 10 },
+    { "catch",     "level 5 subclass past 6 catches",    BenchCatch,    RUNS },
+    { "throw",     "throw class, caught by 1st catch",   BenchThrow,    RUNS },
+    { "throw_inst","throw prebuilt instance, idem.",     BenchThrowInstance, RUNS },
+    { "throw8",    "throw propagated up 8 try levels",   BenchThrow8,   RUNS / 10 },
+    { "throw64",   "throw propagated up 64 try levels",  BenchThrow64,  RUNS / 100 },
+    { "rethrow",   "caught and rethrown at 8 levels",    BenchRethrow,  RUNS / 10 },
+    { "return1",   "return() from 1 try level",          BenchReturn1,  RUNS },
+    { "return2",   "return() from 2 nested try levels",  BenchReturn2,  RUNS },
+    { "return4",   "return() from 4 nested try levels",  BenchReturn4,  RUNS },
+    { "deep",      "100000 nested try levels",           BenchDeep,     10 },
+    { "alloc",     "AllocMalloc() and free() in try",    BenchAlloc,    RUNS },
+    { "malloc",    "malloc() and free()",                BenchMalloc,   RUNS },
+    { "hash",      "context hash lookup, 4096 threads",  BenchHashLookup,   RUNS },
+    { "hash_old",  "legacy chained hash lookup",         BenchLegacyLookup, RUNS / 10 },
+    { "hash_churn","context hash remove and add",        BenchHashChurn,    RUNS },
+    { "hash_ochurn","legacy chained hash remove and add", BenchLegacyChurn, RUNS / 10 },
+};
+
+
+static double Seconds(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned long long Cycles(void)
+{
+#if     defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;                   /* no cycle counter */
+#endif
+}
+
+static char * Build(void)
+{
+    static char build[128];
+
+#ifdef  EXCEPT_NO_SIGMASK
+    strcpy(build, "nosigmask");
+#else
+    strcpy(build, "sigmask");
+#endif
+#ifdef  EXCEPT_STACK_FRAMES
+    strcat(build, "+frames");
+#endif
+#ifdef  EXCEPT_SIGACTION
+    strcat(build, "+sigaction");
+#endif
+#ifdef  EXCEPT_THREAD_LOCAL
+    strcat(build, "+tls");
+#endif
+
+    return build;
+}
+
+static void PrintHeader(Format format)
+{
+    switch (format)
+    {
+    case TEXT:
+#ifdef  EXCEPT_NO_SIGMASK
+        printf("# setjmp() without signal mask\n");
+#else
+        printf("# setjmp() with signal mask\n");
+#endif
+#ifdef  EXCEPT_STACK_FRAMES
+        printf("# exception handles declared by 'try'\n");
+#endif
+#ifdef  EXCEPT_SIGACTION
+        printf("# signal handlers installed once with sigaction()\n");
+#endif
+        break;
+
+    case CSV:
+        printf("build,name,runs,ns_per_op,cycles_per_op\n");
+        break;
+
+    case JSON:
+        printf("{ \"build\": \"%s\", \"results\": [", Build());
+        break;
+    }
+}
+
+static void PrintResult(Format format, Bench *pBench, long runs, double ns,
+                        double cycles, int count)
+{
+    switch (format)
+    {
+    case TEXT:
+        printf("%-12s %10.1f ns/op %10.1f cycles/op  %s\n", pBench->name, ns,
+               cycles, pBench->description);
+        break;
+
+    case CSV:
+        printf("%s,%s,%ld,%.1f,%.1f\n", Build(), pBench->name, runs, ns,
+               cycles);
+        break;
+
+    case JSON:
+        printf("%s\n  { \"name\": \"%s\", \"runs\": %ld, \"ns_per_op\": %.1f, "
+               "\"cycles_per_op\": %.1f }", count > 0 ? "," : "",
+               pBench->name, runs, ns, cycles);
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Format      format = TEXT;
+    int         count = 0;
+    int         i;
+
+    if (argc > 1 && strcmp(argv[1], "-csv") == 0)
+        format = CSV;
+    if (argc > 1 && strcmp(argv[1], "-json") == 0)
+        format = JSON;
+    if (format != TEXT)
+    {
+        argc--;
+        argv++;
+    }
+
+    PrintHeader(format);
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        Bench *                 pBench = &benches[i];
+        long                    runs   = pBench->runs;
+        double                  start;
+        unsigned long long      startCycles;
+        double                  ns;
+        double                  cycles;
+
+        if (argc > 1 && strcmp(argv[1], pBench->name) != 0)
+            continue;
+        if (argc > 2)
+            runs = atol(argv[2]);
+
+        start       = Seconds();
+        startCycles = Cycles();
+        pBench->run(runs);
+        cycles      = (double)(Cycles() - startCycles) / runs;
+        ns          = (Seconds() - start) * 1e9 / runs;
+
+        PrintResult(format, pBench, runs, ns, cycles, count++);
+        fflush(stdout);
+    }
+
+    if (format == JSON)
+        printf("\n] }\n");
+
+    return 0;
+}
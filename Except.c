@@ -32,19 +32,27 @@
  *      simply taking the address of it.
  *      For multi-threading each thread (using exception handling) will get
  *      its private context.  In that case these contexts are kept in a
- *      hash table for fast lookup; the thread ID is used as key.
+ *      hash table for fast lookup; the thread ID is used as key.  When
+ *      EXCEPT_THREAD_LOCAL is defined, each thread also keeps a thread-local
+ *      pointer to its context; lookup then needs no locking at all.  With
+ *      POSIX threads a context is kept until its thread terminates, so the
+ *      hash table (and its mutex) is only used when a context is created or
+ *      cleaned up.
  *
  *      Each 'try' statement is associated with an exception object which
  *      keeps both the state of the 'try' statement and the description of
  *      the exception when occurred in the scope of this 'try' statement.  To
- *      allow nesting, these objects are stored in a LIFO buffer (i.e., stack).
- *      This stack is part of the exception handling context mentioned above.
- *      A 'try' will create such an exception object and will push it on the 
- *      stack.  The matching 'finally' will pop the stack and, when the current
- *      exception object contains a pending exception, it will be handled
- *      (either rethrow or default action), subsequently it will be freed.
- *      For performance reasons the context holds a reference to the top 
- *      of the stack (i.e., the current exception object).
+ *      allow nesting, these objects form a stack: each one points to the
+ *      object of the enclosing 'try' (its <prev> member), and the exception
+ *      handling context mentioned above points to the top of the stack (i.e.,
+ *      the current exception object).  A 'try' will create such an exception
+ *      object and will push it on the stack.  The matching 'finally' will pop
+ *      the stack and, when the current exception object contains a pending
+ *      exception, it will be handled (either rethrow or default action),
+ *      subsequently it will be put back in the pool of free exception objects
+ *      kept by the context; a 'try' takes its object from this pool, so that
+ *      memory is only allocated when a nesting level is reached for the first
+ *      time.
  *
  *      In a multi-threading environment the threads either share the signal
  *      handlers (like on Solaris or Windows NT) or each have a private set
@@ -56,26 +64,53 @@
  *      outermost 'try' of each thread and restored during the matching
  *      'finally'.
  *
- *      There are three different longjmp() destinations which are all kept
- *      by the exception object.  Two of them <throwBuf> and <finalBuf> are
- *      recorded, (using setjmp()) by the 'try' and 'finally' macros
- *      respectively, even before the user 'try' block is being executed.
- *      The third destination <returnBuf> is recorded by the return() macro.
+ *      There are two different longjmp() destinations.  The first, <jumpBuf>,
+ *      is kept by the exception object and is recorded (using setjmp()) by
+ *      the 'try' macro, just before the user 'try' block is being executed.
+ *      The second destination <returnBuf> is recorded by the return() macro.
  *      Having these destinations, routines in this module (that are called
  *      from the macros) can jump to either destination:
  *
- *              throwBuf  - starts 'catch' evaluation; jumped to by
- *                          ExceptThrow() on a 'throw' inside 'try' block
- *              finalBuf  - start 'finally' block execution; jumped to by 
- *                          ExceptThrow() on a 'throw' inside 'catch' or 
- *                          'finally' block (the 'finally' block will not be 
- *                          executed again); or jumped to by ExceptReturn()
- *                          which is invoked from the 'return' macro
+ *              jumpBuf   - jumped to by ExceptThrow() and ExceptReturn();
+ *                          where the macro code continues depends on the
+ *                          <scope> of the exception object: ExceptThrow()
+ *                          sets it to INTERNAL on a 'throw' inside the 'try'
+ *                          block, which starts 'catch' evaluation; for a
+ *                          'throw' inside a 'catch' or 'finally' block, or
+ *                          for a return(), the 'catch' clauses are skipped
+ *                          and 'finally' block execution is started (the
+ *                          'finally' block will not be executed again when
+ *                          it was already running)
  *              returnBuf - execute native return(); jumped to by the 'finally'
  *                          cleanup routine ExceptFinally(); this destination
- *                          is dynamically allocated and is propagated using
- *                          the <pData> exception context member
- *                          
+ *                          is kept by the exception object of the first 'try'
+ *                          of the routine doing the return(), which is the
+ *                          level at which ExceptFinally() performs the jump;
+ *                          so return() needs no memory allocation
+ *
+ *      Having only one destination in the exception object, means that each
+ *      'try' needs only one setjmp().
+ *
+ *      When EXCEPT_STATS is defined, throws, catches, rethrows and exceptions
+ *      lost at the outermost 'finally' are counted per throw site (class,
+ *      file and line).  Each context has its own table of sites, written only
+ *      by its thread, so counting needs neither locking nor atomic read-
+ *      modify-write instructions.  The tables are linked in <statsTables> and
+ *      merged when read by ExceptGetStats(); the table of a context that is
+ *      freed is first added to <retiredStats>.
+ *
+ *      When EXCEPT_TRACE is defined, each context records its last events
+ *      ('try', throw, catch, 'finally', rethrow and signal) in a ring of
+ *      fixed size, again without locking.  A ring is allocated once and kept
+ *      in <traceRings> after its context is freed, both to be reused by a
+ *      new context and to keep the events of ended threads for a dump.
+ *
+ *      When EXCEPT_BACKTRACE is defined, a throw records the return addresses
+ *      of the routines it was called from by following the frame pointers.
+ *      Equal stacks are stored once in the static table <stackTable>, without
+ *      locking and without memory allocation, so that it's safe in a signal
+ *      handler; the exception refers to its entry.  Addresses are only looked
+ *      up in the symbol tables when a stack is printed.
  *
  *      First, the macro code is responsible for the control flow of both
  *      the user and its own code (it supplies all necessary control flow
@@ -112,14 +147,26 @@
  *      1998/12/18 vdbent       Conception.
  */
 
+#if     defined(EXCEPT_BACKTRACE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* dladdr() */
+#endif
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
-#ifdef  EXCEPT_THREAD_POSIX
+#include <time.h>
+#if     defined(EXCEPT_THREAD_POSIX) || \
+        (defined(EXCEPT_BACKTRACE) && defined(__GLIBC__))
 #include <pthread.h>
 #endif
+#if     defined(EXCEPT_TRACE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef  EXCEPT_BACKTRACE
+#include <dlfcn.h>
+#endif
 #include "Except.h"
 #include "Assert.h"
 #include "Hash.h"
@@ -141,10 +188,10 @@ except_class_define(BusError,            RuntimeException);  /* SIGBUS */
 #if     defined(EXCEPT_MT_SHARED) || defined(EXCEPT_MT_PRIVATE)
 #define MULTI_THREADING 1
 #ifdef  EXCEPT_THREAD_POSIX
-#define EXCEPT_THREAD_ID_FUNC           (int)pthread_self
+#define EXCEPT_THREAD_ID_FUNC           (uintptr_t)pthread_self
 #define EXCEPT_THREAD_MUTEX_FUNC        ExceptMutex
 #else
-extern  int EXCEPT_THREAD_ID_FUNC(void);
+extern  uintptr_t EXCEPT_THREAD_ID_FUNC(void);
 extern  int EXCEPT_THREAD_MUTEX_FUNC(int mode);
 #endif
 #else
@@ -152,21 +199,191 @@ extern  int EXCEPT_THREAD_MUTEX_FUNC(int mode);
 #define EXCEPT_THREAD_MUTEX_FUNC(mode)
 #endif
 
+#if     MULTI_THREADING && defined(EXCEPT_THREAD_LOCAL)
+#define THREAD_LOCAL    1
+#if     defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define EXCEPT_TLS      _Thread_local
+#else
+#define EXCEPT_TLS      __thread
+#endif
+#else
+#define THREAD_LOCAL    0
+#endif
+
+#if     MULTI_THREADING && defined(EXCEPT_THREAD_POSIX)
+#define KEEP_CONTEXT    1       /* context lives as long as its thread */
+#else
+#define KEEP_CONTEXT    0       /* context lives as long as outermost 'try' */
+#endif
+
 #ifdef  EXCEPT_MT_SHARED
 #define SHARE_HANDLERS  1
 #else
 #define SHARE_HANDLERS  0
 #endif
 
+#ifdef  EXCEPT_ALT_STACK
+#ifndef EXCEPT_SIGACTION
+#error  "EXCEPT_ALT_STACK requires EXCEPT_SIGACTION"
+#endif
+#if     MULTI_THREADING && !KEEP_CONTEXT
+#error  "EXCEPT_ALT_STACK requires EXCEPT_THREAD_POSIX when multi-threading"
+#endif
+#if     EXCEPT_ALT_STACK > 1
+#define ALT_STACK_SIZE  EXCEPT_ALT_STACK
+#else
+#define ALT_STACK_SIZE  65536           /* default alternate stack size */
+#endif
+#endif
+
+typedef struct _StatsTable              /* throw site counters of a thread */
+{
+    struct _StatsTable *next;           /* next table in <statsTables> */
+    unsigned long       dropped;        /* events of sites not in <sites> */
+    int                 count;          /* number of sites in <sites> */
+    SiteStats   sites[EXCEPT_STATS_SLOTS];  /* hashed by class, file, line */
+} StatsTable;
+
+#ifdef  EXCEPT_STATS
+#if     MULTI_THREADING && !KEEP_CONTEXT
+#error  "EXCEPT_STATS requires EXCEPT_THREAD_POSIX when multi-threading"
+#endif
+#if     EXCEPT_STATS_SLOTS & (EXCEPT_STATS_SLOTS - 1)
+#error  "EXCEPT_STATS_SLOTS must be a power of 2"
+#endif
+
+typedef enum _Event                     /* counted throw site event */
+{
+    THROWN_EVENT,
+    CAUGHT_EVENT,
+    LOST_EVENT,
+    RETHROWN_EVENT
+} Event;
+#endif
+
+#ifdef  EXCEPT_TRACE
+#if     MULTI_THREADING && !KEEP_CONTEXT
+#error  "EXCEPT_TRACE requires EXCEPT_THREAD_POSIX when multi-threading"
+#endif
+#if     EXCEPT_TRACE > 1
+#define TRACE_SIZE      EXCEPT_TRACE
+#else
+#define TRACE_SIZE      256             /* default events per ring (2^n) */
+#endif
+#if     TRACE_SIZE & (TRACE_SIZE - 1)
+#error  "EXCEPT_TRACE must be a power of 2"
+#endif
+
+typedef struct _TraceRing               /* recent events of a context */
+{
+    struct _TraceRing *next;            /* next ring in <traceRings> */
+    int         inUse;                  /* flag if used by a context */
+    unsigned long       head;           /* number of events written */
+    unsigned long       cursor;         /* next event to be dumped */
+    unsigned long       end;            /* head when dump started */
+    TraceRecord records[TRACE_SIZE];    /* indexed by event number */
+} TraceRing;
+#endif
+
+#ifdef  EXCEPT_BACKTRACE
+#ifndef EXCEPT_BACKTRACE_SLOTS
+#define EXCEPT_BACKTRACE_SLOTS  1024    /* interned stacks (2^n) */
+#endif
+#if     EXCEPT_BACKTRACE_SLOTS & (EXCEPT_BACKTRACE_SLOTS - 1)
+#error  "EXCEPT_BACKTRACE_SLOTS must be a power of 2"
+#endif
+#define STACK_EMPTY     0               /* <state> of StackTrace */
+#define STACK_FILLING   1
+#define STACK_SET       2
+#define FRAME_LIMIT     (1024 * 1024)   /* larger stack frame taken as bogus */
+#endif
+
+#ifndef EXCEPT_INITIAL_DEPTH
+#define EXCEPT_INITIAL_DEPTH    32      /* default initial nesting capacity */
+#endif
+
+#define DISPLAY_SLOTS   1024            /* class ancestors in all displays */
+
 static Class            ReturnEvent = { 1, NULL, "ReturnEvent" };
 static Context          defaultContext; /* used when single-threaded */
-static volatile Hash *  pContextHash;   /* thread context hash-table */
+static Hash *           pContextHash;   /* thread context hash-table */
 static volatile int     numThreadsTry;  /* number of threads in 'try' stmt. */
+static int              initialDepth = EXCEPT_INITIAL_DEPTH;    /* of pools */
+static ClassRef         displays[DISPLAY_SLOTS];        /* of all classes */
+static int              displaysUsed;   /* slots of <displays> handed out */
+#ifndef EXCEPT_SIGACTION
 static Handler          sharedSigAbrtHandler;
 static Handler          sharedSigFpeHandler;
 static Handler          sharedSigIllHandler;
 static Handler          sharedSigSegvHandler;
 static Handler          sharedSigBusHandler;
+#endif
+#ifdef  EXCEPT_ALT_STACK
+static Lifo *           altStackPool;   /* free alternate signal stacks */
+#endif
+#ifdef  EXCEPT_SIGACTION
+static int              actionsInstalled;       /* set once by first 'try' */
+static struct sigaction previousActions[NSIG];  /* to chain to outside 'try' */
+#endif
+#ifdef  EXCEPT_STATS
+static StatsTable *     statsTables;    /* tables of existing contexts */
+static StatsTable       retiredStats;   /* sum of tables of freed contexts */
+#endif
+#ifdef  EXCEPT_TRACE
+static TraceRing *      traceRings;     /* rings of all contexts, also freed */
+#endif
+#ifdef  EXCEPT_BACKTRACE
+static StackTrace       stackTable[EXCEPT_BACKTRACE_SLOTS];   /* by hash */
+#endif
+#if     THREAD_LOCAL
+static EXCEPT_TLS Context *pThreadContext;      /* context of this thread */
+#endif
+#if     KEEP_CONTEXT
+static pthread_key_t    contextKey;     /* destroys context at thread exit */
+static pthread_once_t   contextKeyOnce = PTHREAD_ONCE_INIT;
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptMutexCreate - initialize recursive mutex
+ *
+ *  DESCRIPTION
+ *      This routine initializes <exceptMutex> as recursive mutex.  It is only
+ *      needed (and called once through pthread_once()) on platforms lacking a
+ *      static initializer for recursive mutexes.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_THREAD_POSIX
+#ifdef  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+static pthread_mutex_t  exceptMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#define ExceptMutexInit()
+#else
+static pthread_mutex_t  exceptMutex;
+static pthread_once_t   exceptMutexOnce = PTHREAD_ONCE_INIT;
+
+static void ExceptMutexCreate(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&exceptMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#define ExceptMutexInit()       pthread_once(&exceptMutexOnce, ExceptMutexCreate)
+#endif
+#ifdef  EXCEPT_MUTEX_STATS
+static MutexStats       mutexStats;     /* protected by <exceptMutex> */
+#endif
+#endif
 
 
 /******************************************************************************
@@ -176,10 +393,16 @@ static Handler          sharedSigBusHandler;
  *  DESCRIPTION
  *      This routine is the POSIX threads implementation of the function that
  *      locks/unlocks threads before/after accessing shared data.  The <mode>
- *      parameter selects between lock (1) and unlock (0).
+ *      parameter selects between lock (1) and unlock (0).  The mutex is
+ *      recursive: a thread may lock it again while holding it, and must
+ *      unlock it as many times.
+ *
+ *      When EXCEPT_MUTEX_STATS is defined, the acquisitions are counted.  An
+ *      acquisition is contended when an initial trylock fails; the time spent
+ *      in the blocking lock that follows is added to the total wait time.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Updates <mutexStats> (when enabled).
  *
  *  RETURNS
  *      N/A.
@@ -189,47 +412,32 @@ static Handler          sharedSigBusHandler;
 static void ExceptMutex(
     int         mode)           /* 1: lock, 0 unlock */
 {
-    static volatile pthread_mutex_t mutex;
-    static volatile sig_atomic_t    initialized;
-    static volatile sig_atomic_t    ready;
-    static volatile int             count;
-    static volatile pthread_t       tid;
+    ExceptMutexInit();
 
-    if (!initialized && !initialized++)
-    {
-        pthread_mutex_init(&mutex, NULL);
-        ready = 1;
-    }
-    else
-    {
-        while (!ready)
-            ;
-    }
-    
     if (mode == 1)
     {
-        if (tid == pthread_self())
+#ifdef  EXCEPT_MUTEX_STATS
+        if (pthread_mutex_trylock(&exceptMutex) != 0)
         {
-            count++;
-        }
-        else
-        {
-            pthread_mutex_lock(&mutex);
-            tid = pthread_self();
-            count = 1;
+            struct timespec     start;
+            struct timespec     stop;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pthread_mutex_lock(&exceptMutex);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            mutexStats.contended++;
+            mutexStats.waitNs += (stop.tv_sec - start.tv_sec) * 1000000000ULL +
+                                 stop.tv_nsec - start.tv_nsec;
         }
+        mutexStats.acquisitions++;
+#else
+        pthread_mutex_lock(&exceptMutex);
+#endif
     }
     else if (mode == 0)
     {
-        if (tid == pthread_self())
-        {
-            if (--count == 0)
-            {
-                tid = 0;
-                pthread_mutex_unlock(&mutex);
-            }
-        }
-        else if (tid != 0 && tid != pthread_self())
+        if (pthread_mutex_unlock(&exceptMutex) != 0)
         {
             fprintf(stderr, "Except internal error: thread attempts to unlock"
                             " without holding lock\n");
@@ -267,12 +475,12 @@ static void ExceptPrintDebug(
     Context *   pC,             /* pointer to exception context */
     char *      pName)          /* routine name being printed */
 {
-    int n;
+    Except *    pEx;
 
     if (pC == NULL)
         pC = ExceptGetContext(NULL);
 
-    for (n = (pC && pC->exStack) ? LifoCount(pC->exStack) : 0; n != 0; n--)
+    for (pEx = pC ? pC->pEx : NULL; pEx != NULL; pEx = pEx->prev)
         fputs(" ", stderr);
 
     fputs(pName, stderr);
@@ -285,449 +493,2393 @@ static void ExceptPrintDebug(
 
 /******************************************************************************
  *
- *      ExceptGetScope - get exception block scope
+ *      ExceptProbe - static tracing probe point
  *
  *  DESCRIPTION
- *      This routine simply returns the exception handling code scope (OUTSIDE,
- *      INTERNAL, TRY, CATCH or FINALLY).
+ *      This macro places a SystemTap SDT probe point, which perf, bpftrace
+ *      and SystemTap can attach to, named <name> of provider "except".  The
+ *      probe is a single 'nop' instruction; an ELF note in ".note.stapsdt"
+ *      tells the tracer its address and where to find its four arguments:
+ *      the class name string, the file name string, the line number and
+ *      the 'try' nesting depth.  The arguments are passed in registers, so
+ *      that the tracer can read them at the 'nop' without debug info.
+ *
+ *      The note is written here in the layout used by <sys/sdt.h>; including
+ *      that header is avoided because its macro layers would expand probe
+ *      names like 'try' and 'finally' (which are macros of "Except.h").
+ *
+ *      When EXCEPT_PROBES is not defined, or not on x86-64 ELF platforms,
+ *      ExceptProbe() ends up being an empty macro and its arguments are not
+ *      evaluated.
  *
  *  SIDE EFFECTS
  *      None.
  *
  *  RETURNS
- *      The current scope.
+ *      N/A.
  */
 
-Scope ExceptGetScope(
-    Context *   pC)             /* pointer to thread exception context */
+#if     defined(EXCEPT_PROBES) && defined(__ELF__) && defined(__x86_64__)
+#define ExceptProbe(name, className, file, line, depth)                 \
+    __asm__ __volatile__ (                                              \
+        "990:   nop\n"                                                  \
+        "       .pushsection .note.stapsdt,\"?\",\"note\"\n"            \
+        "       .balign 4\n"                                            \
+        "       .4byte 992f-991f, 994f-993f, 3\n"                       \
+        "991:   .asciz \"stapsdt\"\n"                                   \
+        "992:   .balign 4\n"                                            \
+        "993:   .8byte 990b, _.stapsdt.base, 0\n"                       \
+        "       .asciz \"except\"\n"                                    \
+        "       .asciz \"" #name "\"\n"                                 \
+        "       .asciz \"8@%0 8@%1 -4@%2 -4@%3\"\n"                     \
+        "994:   .balign 4\n"                                            \
+        "       .popsection\n"                                          \
+        "       .ifndef _.stapsdt.base\n"                               \
+        "       .pushsection .stapsdt.base,\"aG\",\"progbits\","        \
+                            ".stapsdt.base,comdat\n"                    \
+        "       .weak _.stapsdt.base\n"                                 \
+        "       .hidden _.stapsdt.base\n"                               \
+        "_.stapsdt.base: .space 1\n"                                    \
+        "       .size _.stapsdt.base, 1\n"                              \
+        "       .popsection\n"                                          \
+        "       .endif\n"                                               \
+        : : "r" ((char *)(className)), "r" ((char *)(file)),            \
+            "r" ((int)(line)), "r" ((int)(depth)))
+#else
+#define ExceptProbe(name, className, file, line, depth)
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptStatsSite - find or add throw site in statistics table
+ *
+ *  DESCRIPTION
+ *      This routine looks up the counters of the site where <class> was
+ *      thrown at <file>/<line> in <pTable>, which is an open addressing hash
+ *      table.  When not found, the site is added; the class is stored last
+ *      and with release semantics, so that a thread merging the table (see
+ *      ExceptGetStats()) sees either an empty slot or a complete key.  Sites
+ *      are never removed.  One slot is always kept empty to end the probing.
+ *
+ *  SIDE EFFECTS
+ *      May add site to <pTable>.
+ *
+ *  RETURNS
+ *      Pointer to the site counters, or NULL when the table is full.
+ */
+
+#ifdef  EXCEPT_STATS
+static SiteStats * ExceptStatsSite(
+    StatsTable *pTable,         /* table of sites */
+    ClassRef    class,          /* exception class */
+    char *      file,           /* file name of throw site */
+    int         line)           /* line number of throw site */
 {
-    Scope       scope;
+    SiteStats * pSite;
+    ClassRef    siteClass;
+    uintptr_t   index;
 
-    if (pC == NULL)
-        pC = ExceptGetContext(NULL);
+    index = ((uintptr_t)class >> 4) * 31 + ((uintptr_t)file >> 3);
+    index = (index * 31 + line) & (EXCEPT_STATS_SLOTS - 1);
 
-    ExceptPrintDebug(pC, "ExceptGetScope");
+    while ((siteClass = __atomic_load_n(&pTable->sites[index].class,
+                                        __ATOMIC_ACQUIRE)) != NULL)
+    {
+        pSite = &pTable->sites[index];
+        if (siteClass == class && pSite->file == file && pSite->line == line)
+            return pSite;
 
-    if (pC == NULL || pC->pEx == NULL)
-        scope = OUTSIDE;
-    else
-        scope = ((Except *)LifoPeek(pC->exStack, 1))->scope;
+        index = (index + 1) & (EXCEPT_STATS_SLOTS - 1);
+    }
 
-    return scope;
+    if (pTable->count == EXCEPT_STATS_SLOTS - 1)
+        return NULL;
+
+    pSite = &pTable->sites[index];
+    pSite->file = file;
+    pSite->line = line;
+    __atomic_store_n(&pSite->class, class, __ATOMIC_RELEASE);
+    pTable->count++;
+
+    return pSite;
 }
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptGetContext - get exception handling context of current thread
+ *      ExceptStatsAdd - add to event counter of throw site
  *
  *  DESCRIPTION
- *      This routine looks up the exception handling context of the current
- *      thread.  For performance reasons the static <defaultContext> is used
- *      for single-threading; for multi-threading, the context is
- *      either retrieved from the hash table <pContextHash> or, when not there
- *      yet, will be created on the fly, and added to the hash table.
+ *      This routine adds <amount> to the <event> counter of the site of
+ *      exception <pInstance> in <pTable>, or to the table's dropped events
+ *      counter when the site does not fit.  Only the thread owning <pTable>
+ *      (or holding the mutex for shared tables) writes it, so a plain load
+ *      and store suffice; they are atomic so that readers get whole values.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Updates <pTable>.
  *
  *  RETURNS
- *      Pointer to current exception handling context.
+ *      N/A.
  */
 
-Context * ExceptGetContext(
-    Context *   pC)             /* pointer to thread exception context */
+#ifdef  EXCEPT_STATS
+static void ExceptStatsAdd(
+    StatsTable *pTable,         /* table of sites */
+    ExceptInstance *pInstance,  /* exception description */
+    Event       event,          /* counter to update */
+    unsigned long amount)       /* value to add */
 {
-#if     MULTI_THREADING
-    EXCEPT_THREAD_MUTEX_FUNC(1);
-    if (pC == NULL && pContextHash != NULL)
-        pC = HashLookup(pContextHash, EXCEPT_THREAD_ID_FUNC());
-    EXCEPT_THREAD_MUTEX_FUNC(0);
-    
-    return pC;
-#else
-    return &defaultContext;
-#endif
+    SiteStats *         pSite;
+    unsigned long *     pCounter;
+
+    pSite = ExceptStatsSite(pTable, pInstance->class, pInstance->file,
+                            pInstance->line);
+    if (pSite == NULL)
+        pCounter = &pTable->dropped;
+    else switch (event)
+    {
+    case THROWN_EVENT:   pCounter = &pSite->thrown;   break;
+    case CAUGHT_EVENT:   pCounter = &pSite->caught;   break;
+    case LOST_EVENT:     pCounter = &pSite->lost;     break;
+    case RETHROWN_EVENT: pCounter = &pSite->rethrown; break;
+    }
+
+    __atomic_store_n(pCounter, __atomic_load_n(pCounter, __ATOMIC_RELAXED) +
+                     amount, __ATOMIC_RELAXED);
 }
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptCreateContext - create exception handling context for thread
+ *      ExceptStatsAttach - give context a statistics table
  *
  *  DESCRIPTION
- *      This routine creates and stores the exception handling context for
- *      the current thread.
+ *      This routine allocates the statistics table of context <pC> and links
+ *      it into <statsTables>.  It is called by the first 'try' of a context,
+ *      so that counting itself never allocates memory (an event may be a
+ *      signal turned into an exception).  As the context is kept until its
+ *      thread terminates, this is done once per thread.
  *
  *  SIDE EFFECTS
- *      Adds created context to hash table.
+ *      Adds table to <statsTables>.
  *
  *  RETURNS
- *      Pointer to new exception handling context.
+ *      N/A.
  */
 
-#if     MULTI_THREADING
-static Context * ExceptCreateContext(void)
+#ifdef  EXCEPT_STATS
+static void ExceptStatsAttach(
+    Context *   pC)             /* pointer to thread exception context */
 {
-    Context *   pC;
+    StatsTable *pStats;
 
-    pC = calloc(1, sizeof(Context));
-    if (pC == NULL)
+    pStats = calloc(1, sizeof(StatsTable));
+    if (pStats == NULL)
+    {
         fprintf(stderr, "Except internal error: out of memory.\n");
+        return;
+    }
+
     EXCEPT_THREAD_MUTEX_FUNC(1);
-    HashAdd(pContextHash, EXCEPT_THREAD_ID_FUNC(), pC);
+    pStats->next = statsTables;
+    statsTables = pStats;
     EXCEPT_THREAD_MUTEX_FUNC(0);
-    
-    ExceptPrintDebug(pC, "ExceptCreateContext");
-    
-    return pC;
+
+    pC->pStats = pStats;
 }
-#else
-#define ExceptCreateContext()   NULL
 #endif
 
 
 /******************************************************************************
  *
- *      ExceptGetMessage - get current exception description string
+ *      ExceptCount - count throw site event
  *
  *  DESCRIPTION
- *      This routine composes a descriptive string of the current exception 
- *      <pEx>.  A pointer to this routine is stored in the <getMessage> member
- *      of <pEx>, so a user can invoke it inside a 'catch' block.
+ *      This routine counts <event> for the throw site of exception
+ *      <pInstance> in the statistics table of context <pC>, which was
+ *      attached by its first 'try' (see ExceptStatsAttach()); nothing is
+ *      allocated.  Events outside exception handling scope of a thread
+ *      without context (<pC> is NULL) are counted in <retiredStats>
+ *      directly.  A context without table (out of memory) counts nothing.
+ *
+ *      When EXCEPT_STATS is not defined this routine ends up being an empty
+ *      macro.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Updates statistics table.
  *
  *  RETURNS
- *      Address of static description string which is overwritten by each call.
+ *      N/A.
  */
 
-static char * ExceptGetMessage(void)
+#ifdef  EXCEPT_STATS
+static void ExceptCount(
+    Context *   pC,             /* pointer to thread exception context */
+    ExceptInstance *pInstance,  /* exception description */
+    Event       event)          /* event to count */
 {
-    Context *   pC = ExceptGetContext(NULL);
-
-    ExceptPrintDebug(pC, "ExceptGetMessage");
+    if (pC == NULL)
+    {
+        EXCEPT_THREAD_MUTEX_FUNC(1);
+        ExceptStatsAdd(&retiredStats, pInstance, event, 1);
+        EXCEPT_THREAD_MUTEX_FUNC(0);
 
-    sprintf(pC->message, "%s: file \"%s\", line %d.",
-            pC->pEx->class->name, pC->pEx->file, pC->pEx->line);
+        return;
+    }
 
-    return pC->message;
+    if (pC->pStats != NULL)
+        ExceptStatsAdd(pC->pStats, pInstance, event, 1);
 }
+#else
+#define ExceptCount(pC, pInstance, event)
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptGetClass - get current exception class
+ *      ExceptMergeStats - add statistics table to another
  *
  *  DESCRIPTION
- *      This routine returns the <class> member of the current exception.  A
- *      pointer to this routine is stored in the <getMask> member of <pEx>,
- *      so a user can invoke it inside a 'catch' block.
+ *      This routine adds the counters of all sites in <pFrom> to those in
+ *      <pTo>, which must not be written by another thread.  <pFrom> may be
+ *      the table of another (running) thread; its counters are read as they
+ *      are at that moment.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Updates <pTo>.
  *
  *  RETURNS
- *      Current exception class.
+ *      N/A.
  */
 
-static ClassRef ExceptGetClass(void)
+#ifdef  EXCEPT_STATS
+static void ExceptMergeStats(
+    StatsTable *pTo,            /* table being added to */
+    StatsTable *pFrom)          /* table being added */
 {
-    Context *   pC = ExceptGetContext(NULL);
+    int         i;
 
-    ExceptPrintDebug(pC, "ExceptGetClass");
+    for (i = 0; i < EXCEPT_STATS_SLOTS; i++)
+    {
+        SiteStats *     pSite = &pFrom->sites[i];
+        ExceptInstance  instance;
+
+        instance.class = __atomic_load_n(&pSite->class, __ATOMIC_ACQUIRE);
+        if (instance.class == NULL)
+            continue;
+        instance.file = pSite->file;
+        instance.line = pSite->line;
+
+        ExceptStatsAdd(pTo, &instance, THROWN_EVENT,
+                       __atomic_load_n(&pSite->thrown, __ATOMIC_RELAXED));
+        ExceptStatsAdd(pTo, &instance, CAUGHT_EVENT,
+                       __atomic_load_n(&pSite->caught, __ATOMIC_RELAXED));
+        ExceptStatsAdd(pTo, &instance, LOST_EVENT,
+                       __atomic_load_n(&pSite->lost, __ATOMIC_RELAXED));
+        ExceptStatsAdd(pTo, &instance, RETHROWN_EVENT,
+                       __atomic_load_n(&pSite->rethrown, __ATOMIC_RELAXED));
+    }
 
-    return pC->pEx->class;
+    pTo->dropped += __atomic_load_n(&pFrom->dropped, __ATOMIC_RELAXED);
 }
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptGetData - get current exception associated data
+ *      ExceptRetireStats - keep counters of context being freed
  *
  *  DESCRIPTION
- *      This routine returns the <pData> member of the current exception.  A
- *      pointer to this routine is stored in the <getData> member of <pEx>,
- *      so a user can invoke it inside a 'catch' block.
+ *      This routine adds the statistics table of context <pC> to
+ *      <retiredStats>, removes it from <statsTables> and frees it.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Updates <retiredStats> and <statsTables>.
  *
  *  RETURNS
- *      Current exception associated data.
+ *      N/A.
  */
 
-static void * ExceptGetData(void)
+#if     defined(EXCEPT_STATS) && MULTI_THREADING
+static void ExceptRetireStats(
+    Context *   pC)             /* pointer to thread exception context */
 {
-    Context *   pC = ExceptGetContext(NULL);
+    StatsTable **ppTable;
 
-    ExceptPrintDebug(pC, "ExceptGetData");
+    if (pC->pStats == NULL)
+        return;
 
-    return pC->pEx->pData;
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    ExceptMergeStats(&retiredStats, pC->pStats);
+    for (ppTable = &statsTables; *ppTable != pC->pStats;
+         ppTable = &(*ppTable)->next)
+        ;
+    *ppTable = pC->pStats->next;
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    free(pC->pStats);
+    pC->pStats = NULL;
 }
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptPrintTryTrace - prints the nested 'try' trace
+ *      ExceptTraceTime - get event time stamp
  *
  *  DESCRIPTION
- *      This routine prints the source file name and line number of the 'try'
- *      statement in which the exception occurred and of all its enclosing
- *      'try' statements.
- *
- *      Unless the <pFile> argument is not NULL, it prints to stderr.
+ *      This routine reads the time stamp counter of the processor (on x86),
+ *      which is cheap and, on current processors, runs at constant rate and
+ *      in step on all cores, so that events of different threads can be
+ *      ordered.  On other processors the monotonic clock in nanoseconds is
+ *      used.
  *
  *  SIDE EFFECTS
  *      None.
  *
  *  RETURNS
- *      N/A.
+ *      Time stamp.
  */
 
-static void ExceptPrintTryTrace(
-   FILE *       pFile)          /* stream to which is printed or NULL */
+#ifdef  EXCEPT_TRACE
+static unsigned long long ExceptTraceTime(void)
 {
-    Context *   pC = ExceptGetContext(NULL);
-    int         n;
-    
-    ExceptPrintDebug(pC, "ExceptGetData");
-
-    if (pFile == NULL)
-        pFile = stderr;
-
-#if     MULTI_THREADING
-    fprintf(pFile, "%s occurred in thread %d:\n", pC->pEx->class->name,
-            EXCEPT_THREAD_ID_FUNC());
+    unsigned long long  time;
+#if     defined(__x86_64__) || defined(__i386__)
+    time = __rdtsc();
 #else
-    fprintf(pFile, "%s occurred:\n", pC->pEx->class->name);
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time = now.tv_sec * 1000000000ULL + now.tv_nsec;
 #endif
 
-    for (n = 1; n <= LifoCount(pC->exStack); n++)
-    {
-        Except *    pEx = LifoPeek(pC->exStack, n);
-        
-        fprintf(pFile, "        in 'try' at %s:%d\n", pEx->tryFile, pEx->tryLine);
-    }
+    return time;
 }
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptThrowSignal - 'throw' exception caused by signal
+ *      ExceptTraceAttach - give context an event trace ring
  *
  *  DESCRIPTION
- *      This routine is used as the signal handler for SIGABRT, SIGFPE, SIGILL,
- *      SIGSEGV and SIGBUS.  Only traps (the (ANSI C) signals that deal with
- *      illegal/abnormal/erroneous conditions) are supported.  Installing this
- *      routine as signal handler is done in ExceptTry().
- *
- *      It uses ExceptThrow() to perform the actual 'throw'.
- *
- *      Some OSs (e.g. Solaris) first set the signal's disposition to SIG_DFL
- *      before executing the signal handler.  Therefore this routine is instal-
- *      led as signal handler again each time it is invoked.
+ *      This routine gives context <pC> a ring that is not in use by another
+ *      context; a new ring is only allocated when there is none.  The events
+ *      left in a reused ring stay until they are overwritten.  It is called
+ *      by the first 'try' of a context, so that tracing itself never
+ *      allocates memory.  As the context is kept until its thread terminates,
+ *      this is done once per thread.
  *
  *  SIDE EFFECTS
- *      ExceptThrow() is invoked, so this routine will not return.
+ *      May add ring to <traceRings>.
  *
  *  RETURNS
  *      N/A.
  */
 
-static void ExceptThrowSignal(
-    int         number)         /* signal number */
+#ifdef  EXCEPT_TRACE
+static void ExceptTraceAttach(
+    Context *   pC)             /* pointer to thread exception context */
 {
-    ClassRef    class;
+    TraceRing * pRing;
 
-    ExceptPrintDebug(pC, "ExceptThrowSignal");
-
-    switch (number)
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    for (pRing = traceRings; pRing != NULL && pRing->inUse;
+         pRing = pRing->next)
+        ;
+    if (pRing == NULL && (pRing = calloc(1, sizeof(TraceRing))) != NULL)
     {
-    case SIGABRT: class = AbnormalTermination; break;
-    case SIGFPE:  class = ArithmeticException; break;
-    case SIGILL:  class = IllegalInstruction;  break;
-    case SIGSEGV: class = SegmentationFault;   break;
-#ifdef  SIGBUS
-    case SIGBUS:  class = BusError;            break;
+        pRing->next = traceRings;
+        traceRings = pRing;
+    }
+    if (pRing != NULL)
+        pRing->inUse = 1;
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    pC->pTrace = pRing;
+}
 #endif
+
+
+/******************************************************************************
+ *
+ *      ExceptTraceDetach - release event trace ring of context
+ *
+ *  DESCRIPTION
+ *      This routine marks the ring of context <pC>, which is being freed,
+ *      as no longer in use.  The ring and its events are kept.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#if     defined(EXCEPT_TRACE) && MULTI_THREADING
+static void ExceptTraceDetach(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    if (pC->pTrace != NULL)
+    {
+        EXCEPT_THREAD_MUTEX_FUNC(1);
+        pC->pTrace->inUse = 0;
+        EXCEPT_THREAD_MUTEX_FUNC(0);
+        pC->pTrace = NULL;
     }
+}
+#endif
 
-    signal(number, ExceptThrowSignal);
 
-    class->signalNumber = number;       /* redundant after first time */
-        
-    ExceptThrow(NULL, class, NULL, "?", 0);
+/******************************************************************************
+ *
+ *      ExceptTraceEvent - record event in trace ring
+ *
+ *  DESCRIPTION
+ *      This routine writes an <event> record in the ring of context <pC>,
+ *      overwriting the oldest one when the ring is full.  The nesting depth
+ *      is the number of exception handles in use.  Only the thread of <pC>
+ *      writes its ring; the record is completed before the event count
+ *      <head> is raised (with release semantics), so a reader that checks
+ *      <head> again after copying a record can tell whether it was being
+ *      overwritten (see ExceptTraceRead()).  Nothing is done when <pC> is
+ *      NULL or has no ring.
+ *
+ *      When EXCEPT_TRACE is not defined this routine ends up being an empty
+ *      macro.
+ *
+ *  SIDE EFFECTS
+ *      Updates ring of <pC>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_TRACE
+static void ExceptTraceEvent(
+    Context *   pC,             /* pointer to thread exception context */
+    TraceEvent  event,          /* event to record */
+    ClassRef    class,          /* exception class or NULL */
+    char *      file,           /* file name of event */
+    int         line)           /* line number of event */
+{
+    TraceRing * pRing;
+    TraceRecord *pRecord;
+    unsigned long head;
+
+    if (pC == NULL || (pRing = pC->pTrace) == NULL)
+        return;
+
+    head = pRing->head;
+    pRecord = &pRing->records[head & (TRACE_SIZE - 1)];
+    pRecord->time     = ExceptTraceTime();
+#if     MULTI_THREADING
+    pRecord->threadId = EXCEPT_THREAD_ID_FUNC();
+#else
+    pRecord->threadId = 0;
+#endif
+    pRecord->class    = class;
+    pRecord->file     = file;
+    pRecord->line     = line;
+    pRecord->depth    = pC->poolStats.inUse;
+    pRecord->event    = event;
+    __atomic_store_n(&pRing->head, head + 1, __ATOMIC_RELEASE);
 }
+#else
+#define ExceptTraceEvent(pC, event, class, file, line)
+#endif
 
 
 /******************************************************************************
  *
- *      ExceptInstallHandlers - install signal/trap handlers if needed
+ *      ExceptTraceRead - copy event from trace ring
  *
  *  DESCRIPTION
- *      This routine installs a handler for the traps SIGABRT, SIGFPE, SIGILL,
- *      SIGSEGV and (depending on the platform) SIGBUS.  The previously
- *      installed handlers are stored to be placed back later (when leaving
- *      the outermost 'try' statement) by ExceptResetTrapHandlers().
+ *      This routine copies event number <index> of <pRing> to <pRecord>.
+ *      The ring may be written by its thread meanwhile; when the event has
+ *      been (or was being) overwritten by then, the copy is not valid.
  *
- *      If only install the handlers once when needed.
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      1 when <pRecord> is valid, or 0 otherwise.
+ */
+
+#ifdef  EXCEPT_TRACE
+static int ExceptTraceRead(
+    TraceRing * pRing,          /* ring to read */
+    unsigned long index,        /* event number */
+    TraceRecord *pRecord)       /* receives copy of event */
+{
+    int         valid;
+
+    *pRecord = pRing->records[index & (TRACE_SIZE - 1)];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = (index + TRACE_SIZE > __atomic_load_n(&pRing->head,
+                                                  __ATOMIC_RELAXED));
+
+    return valid;
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptInternStack - find or add stack in table of stacks
+ *
+ *  DESCRIPTION
+ *      This routine looks up the stack of <depth> return addresses <frames>
+ *      in <stackTable>, an open addressing hash table, and adds it when not
+ *      found.  A thread claims an empty slot by changing its state with an
+ *      atomic compare-and-swap, fills it, and then marks it set (with release
+ *      semantics).  Slots being filled by another thread (or by the thread
+ *      that was interrupted by the signal now being thrown) are passed over,
+ *      so a stack may occasionally be stored twice, but there is never any
+ *      waiting.
  *
  *  SIDE EFFECTS
- *      Increments <numThreadsTry> when shared handlers are restored.
+ *      May add stack to <stackTable>.
  *
  *  RETURNS
- *      When stored 1, otherwise 0.
+ *      Pointer to the interned stack, or NULL when the table is full.
  */
 
-static int ExceptInstallHandlers(
-    Context *   pC)             /* pointer to thread exception context */
+#ifdef  EXCEPT_BACKTRACE
+static StackTrace * ExceptInternStack(
+    void **     frames,         /* return addresses, innermost first */
+    int         depth)          /* number of <frames> */
 {
-    int stored = 0;
-    
-    if (pC->exStack == NULL)
+    StackTrace *pStack;
+    uintptr_t   hash = depth;
+    uintptr_t   index;
+    int         state;
+    int         probe;
+    int         i;
+
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+
+    index = hash;
+    for (probe = 0; probe < EXCEPT_BACKTRACE_SLOTS; probe++, index++)
     {
-        pC->exStack = LifoCreate();
+        pStack = &stackTable[index & (EXCEPT_BACKTRACE_SLOTS - 1)];
+        state  = __atomic_load_n(&pStack->state, __ATOMIC_ACQUIRE);
 
-        EXCEPT_THREAD_MUTEX_FUNC(1);
-        if (MULTI_THREADING && SHARE_HANDLERS && numThreadsTry++ == 0)
+        if (state == STACK_EMPTY &&
+            __atomic_compare_exchange_n(&pStack->state, &state, STACK_FILLING,
+                                        0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
         {
-            sharedSigAbrtHandler = signal(SIGABRT, ExceptThrowSignal);
-            sharedSigFpeHandler  = signal(SIGFPE,  ExceptThrowSignal);
-            sharedSigIllHandler  = signal(SIGILL,  ExceptThrowSignal);
-            sharedSigSegvHandler = signal(SIGSEGV, ExceptThrowSignal);
-#ifdef  SIGBUS
-            sharedSigBusHandler  = signal(SIGBUS,  ExceptThrowSignal);
-#endif
+            pStack->hash  = hash;
+            pStack->depth = depth;
+            memcpy(pStack->frames, frames, depth * sizeof(void *));
+            __atomic_store_n(&pStack->state, STACK_SET, __ATOMIC_RELEASE);
 
-            stored = 1;
+            return pStack;
         }
-        else if (!MULTI_THREADING || !SHARE_HANDLERS)
-        {
-            pC->sigAbrtHandler = signal(SIGABRT, ExceptThrowSignal);
-            pC->sigFpeHandler  = signal(SIGFPE,  ExceptThrowSignal);
-            pC->sigIllHandler  = signal(SIGILL,  ExceptThrowSignal);
-            pC->sigSegvHandler = signal(SIGSEGV, ExceptThrowSignal);
-#ifdef  SIGBUS
-            pC->sigBusHandler  = signal(SIGBUS,  ExceptThrowSignal);
+
+        if (state == STACK_SET && pStack->hash == hash &&
+            pStack->depth == depth &&
+            memcmp(pStack->frames, frames, depth * sizeof(void *)) == 0)
+            return pStack;
+    }
+
+    return NULL;
+}
 #endif
 
-            stored = 1;
+
+/******************************************************************************
+ *
+ *      ExceptFindStack - get bounds of stack of thread
+ *
+ *  DESCRIPTION
+ *      This routine stores the lowest address and the size of the stack of
+ *      the current thread in context <pC>, for ExceptCaptureStack().  It
+ *      may allocate memory (for the main thread the C library reads the
+ *      memory map), so it is called when the context is created; when
+ *      single-threading, by the first 'try'.  The bounds are only known with
+ *      the GNU C library; elsewhere they are left unknown (zero).
+ *
+ *  SIDE EFFECTS
+ *      Sets <pC->pThreadStack> and <pC->threadStackSize>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_BACKTRACE
+static void ExceptFindStack(
+    Context *   pC)             /* pointer to thread exception context */
+{
+#ifdef  __GLIBC__
+    pthread_attr_t      attr;
+    void *      pStack;
+    size_t      size;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        if (pthread_attr_getstack(&attr, &pStack, &size) == 0)
+        {
+            pC->pThreadStack    = pStack;
+            pC->threadStackSize = size;
         }
-        EXCEPT_THREAD_MUTEX_FUNC(0);
+        pthread_attr_destroy(&attr);
+    }
+#endif
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptCaptureStack - get stack of routine calls
+ *
+ *  DESCRIPTION
+ *      This routine collects up to EXCEPT_BACKTRACE_DEPTH return addresses
+ *      by following the chain of saved frame pointers, which is much faster
+ *      than unwinding with backtrace(), and interns the result (see
+ *      ExceptInternStack()).  The first <skip> return addresses, which lead
+ *      into the exception handling routines, are left out.  Only routines
+ *      compiled with frame pointers (-fno-omit-frame-pointer) are found.
+ *      The walk stops at a frame pointer that does not point further up the
+ *      same stack, which protects against following garbage; a signal
+ *      handler on an alternate stack may therefore end the walk early.  The
+ *      stack of context <pC> (see ExceptFindStack()) bounds the walk, so that
+ *      a bogus frame pointer of a routine without one is never dereferenced
+ *      outside of it; no stack is captured when its bounds are unknown.
+ *      The routine must not be inlined for the skip count to be right.
+ *
+ *      When EXCEPT_BACKTRACE is not defined ExceptCaptureStack() ends up
+ *      being a macro that gives NULL.
+ *
+ *  SIDE EFFECTS
+ *      May add stack to <stackTable>.
+ *
+ *  RETURNS
+ *      Pointer to the interned stack, or NULL.
+ */
+
+#ifdef  EXCEPT_BACKTRACE
+static __attribute__((noinline)) StackTrace * ExceptCaptureStack(
+    Context *   pC,             /* pointer to thread exception context */
+    int         skip)           /* number of innermost addresses to skip */
+{
+    void *      frames[EXCEPT_BACKTRACE_DEPTH];
+    void **     pFrame = __builtin_frame_address(0);
+    void **     pNext;
+    char *      pLow  = pC->pThreadStack;
+    char *      pHigh = pLow + pC->threadStackSize;
+    int         depth = 0;
+    StackTrace *pStack = NULL;
+
+#ifdef  EXCEPT_ALT_STACK
+    if (pC->pAltStack != NULL && (char *)pFrame >= (char *)pC->pAltStack &&
+        (char *)pFrame < (char *)pC->pAltStack + ALT_STACK_SIZE)
+    {
+        pLow  = pC->pAltStack;          /* in signal handler */
+        pHigh = pLow + ALT_STACK_SIZE;
+    }
+#endif
+    if (pLow == NULL || (char *)pFrame < pLow || (char *)(pFrame + 2) > pHigh)
+        pFrame = NULL;                  /* outside known stack */
+
+    while (pFrame != NULL && depth < EXCEPT_BACKTRACE_DEPTH &&
+           pFrame[1] != NULL)
+    {
+        if (skip > 0)
+            skip--;
+        else
+            frames[depth++] = pFrame[1];
+
+        pNext = pFrame[0];
+        if (pNext <= pFrame || (char *)pNext - (char *)pFrame > FRAME_LIMIT ||
+            (uintptr_t)pNext % sizeof(void *) != 0 ||
+            (char *)(pNext + 2) > pHigh)
+            break;
+        pFrame = pNext;
+    }
+
+    if (depth > 0)
+        pStack = ExceptInternStack(frames, depth);
+
+    return pStack;
+}
+#else
+#define ExceptCaptureStack(pC, skip)    NULL
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptGetScope - get exception block scope
+ *
+ *  DESCRIPTION
+ *      This routine simply returns the exception handling code scope (OUTSIDE,
+ *      INTERNAL, TRY, CATCH or FINALLY).
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      The current scope.
+ */
+
+Scope ExceptGetScope(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    Scope       scope;
+
+    if (pC == NULL)
+        pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptGetScope");
+
+    if (pC == NULL || pC->pEx == NULL)
+        scope = OUTSIDE;
+    else
+        scope = pC->pEx->scope;
+
+    return scope;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetReturnBuf - get destination for return()
+ *
+ *  DESCRIPTION
+ *      This routine returns the return() destination in which the return()
+ *      macro records where the native return is to be performed.  It belongs
+ *      to the innermost exception handle that has its <first> flag set (i.e.,
+ *      the outermost 'try' in the routine doing the return()); this is where
+ *      ExceptFinally() stops propagating the ReturnEvent and does the jump.
+ *      The handles of nested 'try' statements in between are popped before,
+ *      so this destination stays intact until it is used.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to return() destination, or NULL when outside exception scope.
+ */
+
+JMP_BUF * ExceptGetReturnBuf(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    Except *    pEx;
+
+    if (pC == NULL)
+        pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptGetReturnBuf");
+
+    if (pC == NULL || pC->pEx == NULL)
+        return NULL;
+
+    for (pEx = pC->pEx; !pEx->first && pEx->prev != NULL; pEx = pEx->prev)
+        ;
+
+    return &pEx->returnBuf;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetContext - get exception handling context of current thread
+ *
+ *  DESCRIPTION
+ *      This routine looks up the exception handling context of the current
+ *      thread.  For performance reasons the static <defaultContext> is used
+ *      for single-threading; for multi-threading, the context is retrieved
+ *      from the hash table <pContextHash>.  When the thread has no context
+ *      yet, NULL is returned; ExceptTry() will then create one.
+ *
+ *      When EXCEPT_THREAD_LOCAL is defined, each thread keeps a pointer to
+ *      its context in the thread-local <pThreadContext>.  The lookup is then
+ *      reduced to reading this pointer; neither the mutex nor the hash table
+ *      is touched.
+ *
+ *      Otherwise the hash table is read without taking the mutex; HashLookup()
+ *      is safe against the concurrent HashAdd() and HashRemove() calls, which
+ *      are serialized by the mutex.  Only adding and removing contexts lock,
+ *      so threads looking up their context don't contend with each other.
+ *      A lookup never waits for a modification, so ExceptThrowSignal() can
+ *      use it even when the signal interrupted one in the same thread.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to current exception handling context.
+ */
+
+Context * ExceptGetContext(
+    Context *   pC)             /* pointer to thread exception context */
+{
+#if     MULTI_THREADING
+    if (pC == NULL)
+    {
+#if     THREAD_LOCAL
+        pC = pThreadContext;
+#else
+        Hash *  pHash = __atomic_load_n(&pContextHash, __ATOMIC_ACQUIRE);
+
+        if (pHash != NULL)
+            pC = HashLookup(pHash, EXCEPT_THREAD_ID_FUNC());
+#endif
     }
 
-    return stored;
+    return pC;
+#else
+    return &defaultContext;
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptMessageOf - compose exception description string
+ *
+ *  DESCRIPTION
+ *      This routine writes a descriptive string of exception <pEx> into
+ *      <pBuffer>.  The string is truncated to fit <size> bytes.  Unlike the
+ *      <getMessage> and <formatMessage> members, it does not need to look up
+ *      the context, because it is given the handle (<e> of 'catch').
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      <pBuffer>.
+ */
+
+char * ExceptMessageOf(
+    Except *    pEx,            /* exception handle to be described */
+    char *      pBuffer,        /* destination of description string */
+    size_t      size)           /* size of <pBuffer> */
+{
+    snprintf(pBuffer, size, "%s: file \"%s\", line %d.",
+             pEx->class->name, pEx->file, pEx->line);
+
+    return pBuffer;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetMessage - get current exception description string
+ *
+ *  DESCRIPTION
+ *      This routine composes a descriptive string of the current exception 
+ *      <pEx>.  A pointer to this routine is stored in the <getMessage> member
+ *      of <pEx>, so a user can invoke it inside a 'catch' block.
+ *
+ *      The string is only composed the first time it is asked for after a
+ *      'throw': <pMessageEx> tells which handle is described by the context's
+ *      <message>, and ExceptThrow() clears it when that handle is thrown.
+ *
+ *  SIDE EFFECTS
+ *      Updates <pC->message> and <pC->pMessageEx>.
+ *
+ *  RETURNS
+ *      Address of static description string which is overwritten by each call.
+ */
+
+static char * ExceptGetMessage(void)
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptGetMessage");
+
+    if (pC->pMessageEx != pC->pEx)
+    {
+        ExceptMessageOf(pC->pEx, pC->message, sizeof(pC->message));
+        pC->pMessageEx = pC->pEx;
+    }
+
+    return pC->message;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptFormatMessage - write current exception description string
+ *
+ *  DESCRIPTION
+ *      This routine writes a descriptive string of the current exception 
+ *      <pEx> into a buffer supplied by the caller, truncated to <size> bytes.
+ *      A pointer to this routine is stored in the <formatMessage> member of
+ *      <pEx>, so a user can invoke it inside a 'catch' block.  Unlike
+ *      getMessage(), the string is not overwritten by later calls.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      <pBuffer>.
+ */
+
+static char * ExceptFormatMessage(
+    char *      pBuffer,        /* destination of description string */
+    size_t      size)           /* size of <pBuffer> */
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptFormatMessage");
+
+    return ExceptMessageOf(pC->pEx, pBuffer, size);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetClass - get current exception class
+ *
+ *  DESCRIPTION
+ *      This routine returns the <class> member of the current exception.  A
+ *      pointer to this routine is stored in the <getMask> member of <pEx>,
+ *      so a user can invoke it inside a 'catch' block.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Current exception class.
+ */
+
+static ClassRef ExceptGetClass(void)
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptGetClass");
+
+    return pC->pEx->class;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetData - get current exception associated data
+ *
+ *  DESCRIPTION
+ *      This routine returns the <pData> member of the current exception.  A
+ *      pointer to this routine is stored in the <getData> member of <pEx>,
+ *      so a user can invoke it inside a 'catch' block.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Current exception associated data.
+ */
+
+static void * ExceptGetData(void)
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptGetData");
+
+    return pC->pEx->pData;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptPrintTraceOf - prints the nested 'try' trace of exception
+ *
+ *  DESCRIPTION
+ *      This routine prints the source file name and line number of the 'try'
+ *      statement in which exception <pEx> occurred and of all its enclosing
+ *      'try' statements.
+ *
+ *      Unless the <pFile> argument is not NULL, it prints to stderr.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptPrintTraceOf(
+    Except *    pEx,            /* exception handle (<e> of 'catch') */
+    FILE *      pFile)          /* stream to which is printed or NULL */
+{
+    if (pFile == NULL)
+        pFile = stderr;
+
+#if     MULTI_THREADING
+    fprintf(pFile, "%s occurred in thread %lu:\n", pEx->class->name,
+            (unsigned long)EXCEPT_THREAD_ID_FUNC());
+#else
+    fprintf(pFile, "%s occurred:\n", pEx->class->name);
+#endif
+
+    ExceptPrintStackOf(pEx, pFile);
+
+    for (; pEx != NULL; pEx = pEx->prev)
+        fprintf(pFile, "        in 'try' at %s:%d\n", pEx->tryFile, pEx->tryLine);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptPrintStackOf - prints the routine calls leading to throw
+ *
+ *  DESCRIPTION
+ *      This routine prints the stack captured when exception <pEx> was
+ *      thrown (see EXCEPT_BACKTRACE), one call per line, innermost first.
+ *      For each call the address, the object file with the offset in it,
+ *      and (when known by the dynamic linker, e.g. when linked with
+ *      -rdynamic) the routine name are printed; the address is that of the
+ *      call instruction (the return address minus one).  The object file
+ *      offset can be translated to source file and line offline, with
+ *      "addr2line -f -e <file> <offset>".  Symbols are only looked up here,
+ *      never when the exception is thrown.
+ *
+ *      Nothing is printed when no stack was captured.  Unless the <pFile>
+ *      argument is not NULL, it prints to stderr.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptPrintStackOf(
+    Except *    pEx,            /* exception handle (<e> of 'catch') */
+    FILE *      pFile)          /* stream to which is printed or NULL */
+{
+#ifdef  EXCEPT_BACKTRACE
+    StackTrace *pStack = pEx->pStack;
+    int         i;
+
+    if (pFile == NULL)
+        pFile = stderr;
+
+    for (i = 0; pStack != NULL && i < pStack->depth; i++)
+    {
+        char *          pCall = (char *)pStack->frames[i] - 1;
+        Dl_info         info;
+
+        if (dladdr(pCall, &info) == 0 || info.dli_fname == NULL)
+            fprintf(pFile, "        from %p\n", (void *)pCall);
+        else if (info.dli_sname == NULL)
+            fprintf(pFile, "        from %p in %s+%#lx\n", (void *)pCall,
+                    info.dli_fname, (unsigned long)(pCall -
+                                                    (char *)info.dli_fbase));
+        else
+            fprintf(pFile, "        from %p in %s+%#lx (%s+%#lx)\n",
+                    (void *)pCall, info.dli_fname,
+                    (unsigned long)(pCall - (char *)info.dli_fbase),
+                    info.dli_sname,
+                    (unsigned long)(pCall - (char *)info.dli_saddr));
+    }
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptPrintTryTrace - prints the nested 'try' trace
+ *
+ *  DESCRIPTION
+ *      This routine prints the nested 'try' trace of the current exception
+ *      using ExceptPrintTraceOf().  A pointer to this routine is stored in
+ *      the <printTryTrace> member of <pEx>, so a user can invoke it inside a
+ *      'catch' block.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptPrintTryTrace(
+   FILE *       pFile)          /* stream to which is printed or NULL */
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    ExceptPrintDebug(pC, "ExceptPrintTryTrace");
+
+    ExceptPrintTraceOf(pC->pEx, pFile);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptSetMethods - set member functions of exception handle
+ *
+ *  DESCRIPTION
+ *      This routine stores the pointers to the routines above in the member
+ *      function pointers of <pEx>.  These never change, so this is done once
+ *      for a pooled handle when it is allocated, and at each 'throw' for a
+ *      handle that is declared by 'try' (EXCEPT_STACK_FRAMES).
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptSetMethods(
+    Except *    pEx)            /* exception handle */
+{
+    pEx->getClass      = ExceptGetClass;
+    pEx->getMessage    = ExceptGetMessage;
+    pEx->formatMessage = ExceptFormatMessage;
+    pEx->getData       = ExceptGetData;
+    pEx->printTryTrace = ExceptPrintTryTrace;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptThrowSignal - 'throw' exception caused by signal
+ *
+ *  DESCRIPTION
+ *      This routine is used as the signal handler for SIGABRT, SIGFPE, SIGILL,
+ *      SIGSEGV and SIGBUS.  Only traps (the (ANSI C) signals that deal with
+ *      illegal/abnormal/erroneous conditions) are supported.  Installing this
+ *      routine as signal handler is done in ExceptTry().
+ *
+ *      It uses ExceptThrow() to perform the actual 'throw'.
+ *
+ *      Some OSs (e.g. Solaris) first set the signal's disposition to SIG_DFL
+ *      before executing the signal handler.  Therefore this routine is instal-
+ *      led as signal handler again each time it is invoked.
+ *
+ *      Other OSs block the signal while its handler runs.  Normally the mask
+ *      that was saved by the macro code's setjmp() is restored by longjmp().
+ *      When EXCEPT_NO_SIGMASK is defined the mask is not saved, so the signal
+ *      is unblocked here; this is the only place where the mask can differ
+ *      from the one at the time of the 'try'.
+ *
+ *      Neither is needed when EXCEPT_SIGACTION is defined: the handler then
+ *      stays installed and the signal is not blocked (SA_NODEFER).
+ *
+ *  SIDE EFFECTS
+ *      ExceptThrow() is invoked, so this routine will not return.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptThrowSignal(
+    int         number)         /* signal number */
+{
+    ClassRef    class;
+
+    ExceptPrintDebug(pC, "ExceptThrowSignal");
+
+    switch (number)
+    {
+    case SIGABRT: class = AbnormalTermination; break;
+    case SIGFPE:  class = ArithmeticException; break;
+    case SIGILL:  class = IllegalInstruction;  break;
+    case SIGSEGV: class = SegmentationFault;   break;
+#ifdef  SIGBUS
+    case SIGBUS:  class = BusError;            break;
+#endif
+    }
+
+#ifndef EXCEPT_SIGACTION
+    signal(number, ExceptThrowSignal);
+#endif
+
+#if     defined(EXCEPT_NO_SIGMASK) && !defined(EXCEPT_SIGACTION)
+    {
+        sigset_t        set;
+
+        sigemptyset(&set);
+        sigaddset(&set, number);
+#ifdef  EXCEPT_THREAD_POSIX
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+#else
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+#endif
+    }
+#endif
+
+    class->signalNumber = number;       /* redundant after first time */
+
+#if     defined(EXCEPT_TRACE) || defined(EXCEPT_PROBES)
+    {
+        Context *       pCurrent = ExceptGetContext(NULL);
+
+        ExceptTraceEvent(pCurrent, TRACE_SIGNAL, class, "?", 0);
+        ExceptProbe(signal, class->name, "?", number,
+                    pCurrent != NULL ? pCurrent->poolStats.inUse : 0);
+    }
+#endif
+    ExceptThrow(NULL, class, NULL, "?", 0);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptSignalAction - handle signal installed with sigaction()
+ *
+ *  DESCRIPTION
+ *      This routine is the signal handler when EXCEPT_SIGACTION is defined.
+ *      Because it stays installed, also outside 'try' statements, it first
+ *      checks if the thread that got the signal is inside a 'try'.  If so,
+ *      the signal is thrown as exception by ExceptThrowSignal().
+ *
+ *      Otherwise the signal is passed on to the action that was installed
+ *      before: a handler is invoked, an ignored signal is ignored, and for
+ *      the default action that action is installed again and the signal is
+ *      raised (SA_NODEFER lets it be delivered right away).
+ *
+ *  SIDE EFFECTS
+ *      May not return; may reinstall the previous action of <number>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_SIGACTION
+static void ExceptSignalAction(
+    int         number,         /* signal number */
+    siginfo_t * pInfo,          /* signal information */
+    void *      pUContext)      /* interrupted user context */
+{
+    Context *           pC = ExceptGetContext(NULL);
+    struct sigaction *  pPrevious = &previousActions[number];
+
+    if (pC != NULL && pC->pEx != NULL)
+        ExceptThrowSignal(number);
+
+    if (pPrevious->sa_flags & SA_SIGINFO)
+    {
+        pPrevious->sa_sigaction(number, pInfo, pUContext);
+    }
+    else if (pPrevious->sa_handler == SIG_DFL)
+    {
+        sigaction(number, pPrevious, NULL);
+        raise(number);
+    }
+    else if (pPrevious->sa_handler != SIG_IGN)
+    {
+        pPrevious->sa_handler(number);
+    }
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptInstallActions - install signal/trap handlers once
+ *
+ *  DESCRIPTION
+ *      This routine installs ExceptSignalAction() with sigaction() for the
+ *      traps SIGABRT, SIGFPE, SIGILL, SIGSEGV and (depending on the platform)
+ *      SIGBUS, the first time it is called.  The previous actions are kept in
+ *      <previousActions> for ExceptSignalAction() to chain to.  The handlers
+ *      are never restored, so after this 'try' statements don't need any
+ *      system call for signal handling.
+ *
+ *      The signals are not blocked while handled (SA_NODEFER), so that there
+ *      is no need to unblock them when the handler is left with longjmp().
+ *      The handler runs on the alternate signal stack, if there is one
+ *      (SA_ONSTACK).
+ *
+ *  SIDE EFFECTS
+ *      Sets <actionsInstalled>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_SIGACTION
+static void ExceptInstallActions(void)
+{
+    static int          signals[] =
+    {
+        SIGABRT, SIGFPE, SIGILL, SIGSEGV,
+#ifdef  SIGBUS
+        SIGBUS
+#endif
+    };
+    struct sigaction    action;
+    int                 i;
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (!actionsInstalled)
+    {
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = ExceptSignalAction;
+        action.sa_flags     = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+
+        for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+            sigaction(signals[i], &action, &previousActions[signals[i]]);
+
+        __atomic_store_n(&actionsInstalled, 1, __ATOMIC_RELEASE);
+    }
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptInstallHandlers - install signal/trap handlers if needed
+ *
+ *  DESCRIPTION
+ *      This routine installs a handler for the traps SIGABRT, SIGFPE, SIGILL,
+ *      SIGSEGV and (depending on the platform) SIGBUS.  The previously
+ *      installed handlers are stored to be placed back later (when leaving
+ *      the outermost 'try' statement) by ExceptResetTrapHandlers().
+ *
+ *      If only install the handlers once when needed.
+ *
+ *      When EXCEPT_SIGACTION is defined, ExceptInstallActions() is used
+ *      instead, only for the first 'try' of the process.
+ *
+ *  SIDE EFFECTS
+ *      Increments <numThreadsTry> when shared handlers are restored.
+ *
+ *  RETURNS
+ *      When stored 1, otherwise 0.
+ */
+
+static int ExceptInstallHandlers(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    int stored = 0;
+
+#ifdef  EXCEPT_SIGACTION
+    if (!__atomic_load_n(&actionsInstalled, __ATOMIC_ACQUIRE))
+        ExceptInstallActions();
+#else
+    if (pC->pEx == NULL)
+    {
+        EXCEPT_THREAD_MUTEX_FUNC(1);
+        if (MULTI_THREADING && SHARE_HANDLERS && numThreadsTry++ == 0)
+        {
+            sharedSigAbrtHandler = signal(SIGABRT, ExceptThrowSignal);
+            sharedSigFpeHandler  = signal(SIGFPE,  ExceptThrowSignal);
+            sharedSigIllHandler  = signal(SIGILL,  ExceptThrowSignal);
+            sharedSigSegvHandler = signal(SIGSEGV, ExceptThrowSignal);
+#ifdef  SIGBUS
+            sharedSigBusHandler  = signal(SIGBUS,  ExceptThrowSignal);
+#endif
+
+            stored = 1;
+        }
+        else if (!MULTI_THREADING || !SHARE_HANDLERS)
+        {
+            pC->sigAbrtHandler = signal(SIGABRT, ExceptThrowSignal);
+            pC->sigFpeHandler  = signal(SIGFPE,  ExceptThrowSignal);
+            pC->sigIllHandler  = signal(SIGILL,  ExceptThrowSignal);
+            pC->sigSegvHandler = signal(SIGSEGV, ExceptThrowSignal);
+#ifdef  SIGBUS
+            pC->sigBusHandler  = signal(SIGBUS,  ExceptThrowSignal);
+#endif
+
+            stored = 1;
+        }
+        EXCEPT_THREAD_MUTEX_FUNC(0);
+    }
+#endif
+
+    return stored;
+}
+    
+
+/******************************************************************************
+ *
+ *      ExceptRestoreHandlers - restores signal/trap handlers if needed
+ *
+ *  DESCRIPTION
+ *      This routine restores the application original handlers for SIGABRT,
+ *      SIGFPE, SIGILL, SIGSEGV and (depending on the platform) SIGBUS.  The
+ *      The original handlers are stored by ExceptInstallHandlers().
+ *
+ *      It only restored the handlers once when needed.
+ *
+ *      When EXCEPT_SIGACTION is defined, nothing needs to be restored: the
+ *      handler passes signals that occur outside 'try' on to the original
+ *      action.
+ *
+ *  SIDE EFFECTS
+ *      Decrements <numThreadsTry> when shared handlers are restored.
+ *
+ *  RETURNS
+ *      When restored 1, otherwise 0.
+ */
+
+static int ExceptRestoreHandlers(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    int restored = 0;
+
+#ifdef  EXCEPT_SIGACTION
+    restored = 1;               /* raise() reaches previous action */
+#else
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (MULTI_THREADING && SHARE_HANDLERS && --numThreadsTry == 0)
+    {
+        signal(SIGABRT, sharedSigAbrtHandler);
+        signal(SIGFPE,  sharedSigFpeHandler);
+        signal(SIGILL,  sharedSigIllHandler);
+        signal(SIGSEGV, sharedSigSegvHandler);
+#ifdef  SIGBUS
+        signal(SIGBUS,  sharedSigBusHandler);
+#endif
+
+        restored = 1;
+    }
+    else if (!MULTI_THREADING || !SHARE_HANDLERS)
+    {
+        signal(SIGABRT, pC->sigAbrtHandler);
+        signal(SIGFPE,  pC->sigFpeHandler);
+        signal(SIGILL,  pC->sigIllHandler);
+        signal(SIGSEGV, pC->sigSegvHandler);
+#ifdef  SIGBUS
+        signal(SIGBUS,  pC->sigBusHandler);
+#endif
+
+        restored = 1;
+    }
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+#endif
+    
+    return restored;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptCreateAltStack - set up alternate signal stack for thread
+ *
+ *  DESCRIPTION
+ *      This routine gives the current thread an alternate signal stack of
+ *      ALT_STACK_SIZE bytes (EXCEPT_ALT_STACK), on which ExceptSignalAction()
+ *      runs (SA_ONSTACK).  Because of this a SIGSEGV caused by a stack over-
+ *      flow can be handled, and be thrown as SegmentationFault to the nearest
+ *      'try' like any other.  The stack is taken from <altStackPool>, or is
+ *      allocated when the pool is empty.
+ *
+ *      It is called when the context <pC> of the thread is created; when
+ *      single-threading, by the first 'try'.  Because a context is kept until
+ *      its thread terminates, this is done once per thread; that is why
+ *      multi-threading requires EXCEPT_THREAD_POSIX.
+ *
+ *  SIDE EFFECTS
+ *      Sets <pC->pAltStack>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_ALT_STACK
+static void ExceptCreateAltStack(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    stack_t     altStack;
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (altStackPool != NULL && LifoCount(altStackPool) > 0)
+        pC->pAltStack = LifoPop(altStackPool);
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    if (pC->pAltStack == NULL)
+        pC->pAltStack = malloc(ALT_STACK_SIZE);
+    if (pC->pAltStack == NULL)
+    {
+        fprintf(stderr, "Except internal error: out of memory.\n");
+        return;
+    }
+
+    altStack.ss_sp    = pC->pAltStack;
+    altStack.ss_size  = ALT_STACK_SIZE;
+    altStack.ss_flags = 0;
+    sigaltstack(&altStack, NULL);
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptFreeAltStack - put alternate signal stack back in pool
+ *
+ *  DESCRIPTION
+ *      This routine puts the alternate signal stack of context <pC> in the
+ *      pool.  When it is the stack of the current thread (i.e., when <pC> is
+ *      not freed on behalf of a ceased thread), it is disabled first.
+ *
+ *  SIDE EFFECTS
+ *      Clears <pC->pAltStack>.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_ALT_STACK
+static void ExceptFreeAltStack(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    stack_t     altStack;
+
+    if (pC->pAltStack == NULL)
+        return;
+
+    if (sigaltstack(NULL, &altStack) == 0 && altStack.ss_sp == pC->pAltStack)
+    {
+        altStack.ss_flags = SS_DISABLE;
+        sigaltstack(&altStack, NULL);
+    }
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (altStackPool == NULL)
+        altStackPool = LifoCreate();
+    LifoPush(altStackPool, pC->pAltStack);
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    pC->pAltStack = NULL;
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptFreeContext - free exception handling context
+ *
+ *  DESCRIPTION
+ *      This routine frees the context <pC> of a thread, including the free
+ *      exception handles kept in its pool.  The exception handle stack must
+ *      be empty.  The alternate signal stack (EXCEPT_ALT_STACK) is kept for
+ *      reuse, the throw site counters (EXCEPT_STATS) are kept in
+ *      <retiredStats>, and the event trace ring (EXCEPT_TRACE) is kept with
+ *      its events.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#if     MULTI_THREADING
+static void ExceptFreeContext(
+    Context *   pC)             /* pointer to thread exception context */
+{
+#ifdef  EXCEPT_ALT_STACK
+    ExceptFreeAltStack(pC);
+#endif
+#ifdef  EXCEPT_STATS
+    ExceptRetireStats(pC);
+#endif
+#ifdef  EXCEPT_TRACE
+    ExceptTraceDetach(pC);
+#endif
+    if (pC->exPool != NULL)
+        LifoDestroyData(pC->exPool);
+    free(pC);
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptDiscardStack - discard exception handles of ceased thread
+ *
+ *  DESCRIPTION
+ *      This routine puts the handles on the exception handle stack of a
+ *      context whose thread ceased to exist while inside a 'try' statement
+ *      back in the pool, and restores the signal handlers as the outermost
+ *      'finally' would have done.
+ *      Nothing is done when the thread was outside exception handling scope.
+ *
+ *      When EXCEPT_STACK_FRAMES is defined, the handles were automatic
+ *      variables of the thread; its stack may be gone or reused, so the
+ *      handle stack is only emptied, without reading the handles.
+ *
+ *  SIDE EFFECTS
+ *      May restore signal handlers.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#if     MULTI_THREADING
+static void ExceptDiscardStack(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    if (pC->pEx != NULL)
+    {
+        ExceptRestoreHandlers(pC);
+#ifdef  EXCEPT_STACK_FRAMES
+        pC->pEx = NULL;
+#else
+        while (pC->pEx != NULL)
+        {
+            Except *    pEx = pC->pEx;
+
+            pC->pEx = pEx->prev;
+            LifoPush(pC->exPool, pEx);
+        }
+#endif
+        pC->poolStats.inUse = 0;
+    }
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptThreadCleanup - cleanup exception handling for ceased thread
+ *
+ *  DESCRIPTION
+ *      This routine, which is used by the except_thread_cleanup() macro,
+ *      removes the exception context of the <threadId> thread from
+ *      <pContextHash> and frees it.  With -1 as <threadId> the calling thread
+ *      frees its own context (outside any 'try'); its thread-local pointer
+ *      and thread-specific value are cleared too, so that its next 'try'
+ *      creates a new context.
+ *
+ *      It must be used after the specified thread has ceased to exist and
+ *      when there is reason to assume that this thread did not perform a
+ *      cleanup itself; for example when it was killed.  With POSIX threads a
+ *      context is freed automatically when its thread terminates normally,
+ *      on other platforms by the outermost 'finally'.
+ *
+ *      In a multi-threading environment that recycles IDs, this routine must
+ *      be called as soon as possible after the specified thread was stopped
+ *      without this automatic cleanup.  To prevent hazardous situations,
+ *      care must be taken that no new threads are created in between
+ *      stopping a thread and cleaning it up using this routine.
+ *
+ *  SIDE EFFECTS
+ *      May remove a context from <pContextHash> and free it.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptThreadCleanup(
+    uintptr_t   threadId)       /* ID of ceased thread or -1 for self */
+{
+#if     MULTI_THREADING
+    validate(threadId != EXCEPT_THREAD_ID_FUNC(), NOTHING);
+    if (threadId == (uintptr_t)-1)
+        threadId = EXCEPT_THREAD_ID_FUNC();
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (pContextHash != NULL)
+    {
+        Context * pC;
+        
+        pC = HashLookup(pContextHash, threadId);
+        if (pC != NULL && threadId == EXCEPT_THREAD_ID_FUNC())
+        {
+#if     THREAD_LOCAL
+            pThreadContext = NULL;
+#endif
+#if     KEEP_CONTEXT
+            pthread_setspecific(contextKey, NULL);      /* no destructor */
+#endif
+        }
+        if (pC != NULL)
+        {
+            ExceptDiscardStack(pC);
+            ExceptFreeContext(HashRemove(pContextHash, threadId));
+        }
+    }    
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptDestroyContext - destroy exception handling context at thread exit
+ *
+ *  DESCRIPTION
+ *      This routine is the destructor of <contextKey>; it is invoked by the
+ *      POSIX threads library when a thread that has a context terminates.
+ *      It removes the context from <pContextHash> and frees it.  When the
+ *      thread ended inside a 'try' statement (e.g., by pthread_exit()), the
+ *      exception handles that are still stacked are freed as well (with the
+ *      pool).
+ *
+ *  SIDE EFFECTS
+ *      Removes context from hash table.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#if     KEEP_CONTEXT
+static void ExceptDestroyContext(
+    void *      pArg)           /* pointer to thread exception context */
+{
+    Context *   pC = pArg;
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    HashRemove(pContextHash, EXCEPT_THREAD_ID_FUNC());
+    ExceptDiscardStack(pC);
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    ExceptFreeContext(pC);
+}
+
+
+static void ExceptCreateContextKey(void)
+{
+    pthread_key_create(&contextKey, ExceptDestroyContext);
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptCreateContext - create exception handling context for thread
+ *
+ *  DESCRIPTION
+ *      This routine creates and stores the exception handling context for
+ *      the current thread.  The hash table <pContextHash> is created when
+ *      this is the first context.
+ *
+ *      With EXCEPT_THREAD_LOCAL the context is also stored in the thread-local
+ *      <pThreadContext>.  For POSIX threads, the context is kept until the
+ *      thread terminates (instead of being destroyed by the outermost
+ *      'finally'), so that creation and hash table registration are done
+ *      only once per thread, and its handle pool is reused by all 'try'
+ *      statements of the thread.
+ *
+ *      With EXCEPT_ALT_STACK the thread also gets its alternate signal stack,
+ *      and with EXCEPT_BACKTRACE the bounds of its stack are looked up.
+ *      (The event trace ring of EXCEPT_TRACE is attached by ExceptTry().)
+ *
+ *  SIDE EFFECTS
+ *      Adds created context to hash table.
+ *
+ *  RETURNS
+ *      Pointer to new exception handling context.
+ */
+
+#if     MULTI_THREADING
+static Context * ExceptCreateContext(void)
+{
+    Context *   pC;
+
+    pC = calloc(1, sizeof(Context));
+    if (pC == NULL)
+        fprintf(stderr, "Except internal error: out of memory.\n");
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    if (pContextHash == NULL)
+        __atomic_store_n(&pContextHash, HashCreate(), __ATOMIC_RELEASE);
+    HashAdd(pContextHash, EXCEPT_THREAD_ID_FUNC(), pC);
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+#if     THREAD_LOCAL
+    pThreadContext = pC;
+#endif
+#if     KEEP_CONTEXT
+    pthread_once(&contextKeyOnce, ExceptCreateContextKey);
+    pthread_setspecific(contextKey, pC);
+#endif
+#ifdef  EXCEPT_ALT_STACK
+    ExceptCreateAltStack(pC);
+#endif
+#ifdef  EXCEPT_BACKTRACE
+    ExceptFindStack(pC);
+#endif
+
+    ExceptPrintDebug(pC, "ExceptCreateContext");
+    
+    return pC;
+}
+#else
+#define ExceptCreateContext()   NULL
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptReleaseContext - release context when leaving outermost 'try'
+ *
+ *  DESCRIPTION
+ *      This routine is called when the outermost 'finally' of the current
+ *      thread has been executed.  For multi-threading the context is removed
+ *      from the hash table <pContextHash> and freed, unless it is kept until
+ *      the thread terminates (refer to ExceptCreateContext()).  Otherwise
+ *      nothing needs to be done.
+ *
+ *  SIDE EFFECTS
+ *      May remove context from hash table.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptReleaseContext(
+    Context *   pC)             /* pointer to thread exception context */
+{
+#if     MULTI_THREADING && !KEEP_CONTEXT
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    ExceptFreeContext(HashRemove(pContextHash, EXCEPT_THREAD_ID_FUNC()));
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+#if     THREAD_LOCAL
+    pThreadContext = NULL;
+#endif
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptNewHandle - get exception handle from pool
+ *
+ *  DESCRIPTION
+ *      This routine takes a cleared exception handle from the pool of free
+ *      handles of context <pC>.  Only when the pool is empty, a new handle
+ *      is allocated; so once the pool has grown to the deepest 'try' nesting
+ *      level, no more memory is allocated.  Handles are recycled in LIFO
+ *      order, which keeps recently used (and cached) handles in use.
+ *
+ *      When <pFrame> is not NULL, the 'try' macro supplies the handle itself
+ *      (see EXCEPT_STACK_FRAMES in "Except.h"); it is an automatic variable
+ *      of the routine doing the 'try' and is used instead.  It is marked so
+ *      that it won't be put in the pool.
+ *
+ *      Only the members in front of the jump buffer are cleared; the jump
+ *      buffer is always filled by the macro code before being used.
+ *
+ *      When a handle can't be allocated the process is aborted: without a
+ *      handle the 'try' can't be entered, nor can OutOfMemoryError be thrown.
+ *
+ *  SIDE EFFECTS
+ *      Updates the pool counters.  Aborts when out of memory.
+ *
+ *  RETURNS
+ *      Pointer to cleared exception handle.
+ */
+
+static Except * ExceptNewHandle(
+    Context *   pC,             /* pointer to thread exception context */
+    Except *    pFrame)         /* handle supplied by 'try' or NULL */
+{
+    Except *    pEx = pFrame;
+
+    if (pEx == NULL)
+    {
+        if (pC->exPool == NULL)
+            pC->exPool = LifoCreateSized(initialDepth);
+
+        if (LifoCount(pC->exPool) > 0)
+        {
+            pEx = LifoPop(pC->exPool);
+        }
+        else
+        {
+            pEx = malloc(sizeof(Except));
+            if (pEx == NULL)
+            {
+                fprintf(stderr, "Except internal error: out of memory.\n");
+                abort();
+            }
+            ExceptSetMethods(pEx);
+            pC->poolStats.allocated++;
+        }
+    }
+
+    if (++pC->poolStats.inUse > pC->poolStats.highWater)
+        pC->poolStats.highWater = pC->poolStats.inUse;
+
+    memset(pEx, 0, offsetof(Except, jumpBuf));
+    pEx->onStack = (pFrame != NULL);
+
+    return pEx;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptFreeHandle - return exception handle to pool
+ *
+ *  DESCRIPTION
+ *      This routine puts an exception handle that is no longer used back in
+ *      the pool of context <pC>.  A handle supplied by the 'try' macro is not
+ *      put in the pool.
+ *
+ *  SIDE EFFECTS
+ *      Updates the pool counters.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptFreeHandle(
+    Context *   pC,             /* pointer to thread exception context */
+    Except *    pEx)            /* exception handle being freed */
+{
+    pC->poolStats.inUse--;
+    if (!pEx->onStack)
+        LifoPush(pC->exPool, pEx);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetPoolStats - get exception handle pool counters
+ *
+ *  DESCRIPTION
+ *      This routine copies the exception handle pool counters of the current
+ *      thread to <pStats>: the number of handles in use, the number of
+ *      handles allocated, and the high-water mark of handles in use (i.e.,
+ *      the deepest 'try' nesting level reached).  All counters are zero when
+ *      the thread has no exception handling context.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptGetPoolStats(
+    PoolStats * pStats)         /* receives pool counters */
+{
+    Context *   pC = ExceptGetContext(NULL);
+
+    if (pC != NULL)
+        *pStats = pC->poolStats;
+    else
+        memset(pStats, 0, sizeof(PoolStats));
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetMutexStats - get mutex contention counters
+ *
+ *  DESCRIPTION
+ *      This routine copies the counters of the mutex that protects the data
+ *      shared by threads to <pStats>: the number of acquisitions, the number
+ *      of these that had to wait because another thread held the mutex, and
+ *      the total waiting time in nanoseconds.  The counters are process wide
+ *      and only kept when EXCEPT_MUTEX_STATS is defined (for POSIX threads);
+ *      otherwise they are all zero.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptGetMutexStats(
+    MutexStats *pStats)         /* receives mutex counters */
+{
+#if     defined(EXCEPT_THREAD_POSIX) && defined(EXCEPT_MUTEX_STATS)
+    ExceptMutexInit();
+    pthread_mutex_lock(&exceptMutex);
+    *pStats = mutexStats;
+    pthread_mutex_unlock(&exceptMutex);
+#else
+    memset(pStats, 0, sizeof(MutexStats));
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptCompareSites - compare throw sites for sorting
+ *
+ *  DESCRIPTION
+ *      This routine is the qsort() comparison function that orders throw
+ *      sites by descending number of throws, and then by file and line.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Negative, zero or positive, like strcmp().
+ */
+
+#ifdef  EXCEPT_STATS
+static int ExceptCompareSites(
+    const void *p1,             /* first site */
+    const void *p2)             /* second site */
+{
+    const SiteStats *   pSite1 = p1;
+    const SiteStats *   pSite2 = p2;
+    int                 result;
+
+    if (pSite1->thrown != pSite2->thrown)
+        result = pSite1->thrown < pSite2->thrown ? 1 : -1;
+    else if ((result = strcmp(pSite1->file, pSite2->file)) == 0)
+        result = pSite1->line - pSite2->line;
+
+    return result;
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptSnapshotStats - merge statistics of all threads
+ *
+ *  DESCRIPTION
+ *      This routine merges <retiredStats> and the statistics tables of all
+ *      contexts into <pTable>.  The tables of running threads are read while
+ *      these threads go on counting, so a snapshot is not atomic across
+ *      counters; each single counter value is exact at some moment.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Number of sites found, which are packed at the start of <pTable>'s
+ *      site array in the order of ExceptCompareSites().
+ */
+
+#ifdef  EXCEPT_STATS
+static int ExceptSnapshotStats(
+    StatsTable *pTable)         /* receives merged counters */
+{
+    StatsTable *pFrom;
+    int         count = 0;
+    int         i;
+
+    EXCEPT_THREAD_MUTEX_FUNC(1);
+    ExceptMergeStats(pTable, &retiredStats);
+    for (pFrom = statsTables; pFrom != NULL; pFrom = pFrom->next)
+        ExceptMergeStats(pTable, pFrom);
+    EXCEPT_THREAD_MUTEX_FUNC(0);
+
+    for (i = 0; i < EXCEPT_STATS_SLOTS; i++)
+    {
+        if (pTable->sites[i].class != NULL)
+            pTable->sites[count++] = pTable->sites[i];
+    }
+    qsort(pTable->sites, count, sizeof(SiteStats), ExceptCompareSites);
+
+    return count;
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *      ExceptGetStats - get throw site statistics
+ *
+ *  DESCRIPTION
+ *      This routine copies the counters of at most <max> throw sites to the
+ *      array <pStats>, most thrown first.  The counters of all threads,
+ *      including those that have ended, are added up.  Sites are counted
+ *      only when EXCEPT_STATS is defined; there are at most one less than
+ *      EXCEPT_STATS_SLOTS sites, events of further sites are only counted
+ *      as dropped (see ExceptPrintStats()).
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Number of sites copied to <pStats>.
+ */
+
+int ExceptGetStats(
+    SiteStats * pStats,         /* receives site counters */
+    int         max)            /* number of elements of <pStats> */
+{
+    int         count = 0;
+#ifdef  EXCEPT_STATS
+    StatsTable *pTable = calloc(1, sizeof(StatsTable));
+
+    if (pTable != NULL)
+    {
+        count = ExceptSnapshotStats(pTable);
+        if (count > max)
+            count = max;
+        memcpy(pStats, pTable->sites, count * sizeof(SiteStats));
+        free(pTable);
+    }
+#endif
+
+    return count;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptPrintStats - print throw site statistics
+ *
+ *  DESCRIPTION
+ *      This routine prints the counters of all throw sites (see
+ *      ExceptGetStats()) on <pFile>, as a table or, when <json> is not zero,
+ *      as a JSON object with the number of dropped events and an array of
+ *      sites.  Without EXCEPT_STATS the table/array is empty.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptPrintStats(
+    FILE *      pFile,          /* output file */
+    int         json)           /* flag if JSON format */
+{
+    StatsTable *pTable = NULL;
+    int         count = 0;
+    int         i;
+
+#ifdef  EXCEPT_STATS
+    if ((pTable = calloc(1, sizeof(StatsTable))) != NULL)
+        count = ExceptSnapshotStats(pTable);
+#endif
+
+    if (json)
+        fprintf(pFile, "{\"dropped\": %lu, \"sites\": [",
+                pTable != NULL ? pTable->dropped : 0);
+    else
+        fprintf(pFile, "%-24s %-24s %10s %10s %10s %10s\n", "class", "site",
+                "thrown", "caught", "lost", "rethrown");
+
+    for (i = 0; i < count; i++)
+    {
+        SiteStats *     pSite = &pTable->sites[i];
+
+        if (json)
+            fprintf(pFile, "%s\n  {\"class\": \"%s\", \"file\": \"%s\", "
+                    "\"line\": %d, \"thrown\": %lu, \"caught\": %lu, "
+                    "\"lost\": %lu, \"rethrown\": %lu}", i > 0 ? "," : "",
+                    pSite->class->name, pSite->file, pSite->line,
+                    pSite->thrown, pSite->caught, pSite->lost,
+                    pSite->rethrown);
+        else
+        {
+            char        site[256];
+
+            snprintf(site, sizeof(site), "%s:%d", pSite->file, pSite->line);
+            fprintf(pFile, "%-24s %-24s %10lu %10lu %10lu %10lu\n",
+                    pSite->class->name, site, pSite->thrown, pSite->caught,
+                    pSite->lost, pSite->rethrown);
+        }
+    }
+
+    if (json)
+        fprintf(pFile, "%s]}\n", count > 0 ? "\n" : "");
+    else if (pTable != NULL && pTable->dropped > 0)
+        fprintf(pFile, "(%lu events of further sites dropped)\n",
+                pTable->dropped);
+
+    free(pTable);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptEventName - get name of traced event
+ *
+ *  DESCRIPTION
+ *      This routine returns the name of <event> as used by ExceptPrintEvents().
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Name string.
+ */
+
+char * ExceptEventName(
+    TraceEvent  event)          /* traced event */
+{
+    static char *       names[] = { "try", "throw", "catch", "finally",
+                                    "rethrow", "signal" };
+    char *              name = "?";
+
+    if (event >= TRACE_TRY && event <= TRACE_SIGNAL)
+        name = names[event];
+
+    return name;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptGetEvents - get recent events of current thread
+ *
+ *  DESCRIPTION
+ *      This routine copies the last (at most <max>) events recorded by the
+ *      current thread to <pRecords>, oldest first.  Events are only recorded
+ *      when EXCEPT_TRACE is defined.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Number of events copied to <pRecords>.
+ */
+
+int ExceptGetEvents(
+    TraceRecord *pRecords,      /* receives events */
+    int         max)            /* number of elements of <pRecords> */
+{
+    int         count = 0;
+#ifdef  EXCEPT_TRACE
+    Context *   pC = ExceptGetContext(NULL);
+    unsigned long index;
+    unsigned long head;
+
+    if (pC != NULL && pC->pTrace != NULL && max > 0)
+    {
+        head  = pC->pTrace->head;
+        index = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+        if (head - index > max)
+            index = head - max;
+
+        while (index < head)
+            pRecords[count++] = pC->pTrace->records[index++ & (TRACE_SIZE-1)];
+    }
+#endif
+
+    return count;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptPrintRecord - print traced event
+ *
+ *  DESCRIPTION
+ *      This routine prints <pRecord> as one line on <pFile>, with its time
+ *      relative to <start>, in the columns printed by ExceptPrintEvents().
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+#ifdef  EXCEPT_TRACE
+static void ExceptPrintRecord(
+    FILE *      pFile,          /* output file */
+    TraceRecord *pRecord,       /* event to print */
+    unsigned long long start)   /* time shown as 0 */
+{
+    fprintf(pFile, "%14llu %18lx %5d %-8s %-24s %s:%d\n",
+            pRecord->time - start, (unsigned long)pRecord->threadId,
+            pRecord->depth, ExceptEventName(pRecord->event),
+            pRecord->class != NULL ? pRecord->class->name : "-",
+            pRecord->file, pRecord->line);
 }
-    
+#endif
+
 
 /******************************************************************************
  *
- *      ExceptRestoreHandlers - restores signal/trap handlers if needed
+ *      ExceptPrintEvents - dump recent events of all threads
  *
  *  DESCRIPTION
- *      This routine restores the application original handlers for SIGABRT,
- *      SIGFPE, SIGILL, SIGSEGV and (depending on the platform) SIGBUS.  The
- *      The original handlers are stored by ExceptInstallHandlers().
- *
- *      It only restored the handlers once when needed.
+ *      This routine prints the events in all trace rings on <pFile>, merged
+ *      in time stamp order, with the time relative to the first event shown.
+ *      The rings of ended threads are included.  Threads may go on recording
+ *      meanwhile; events recorded after the dump started are not shown, and
+ *      events that are overwritten while the dump runs are skipped.  No
+ *      memory is allocated, so that it can be used when things went wrong;
+ *      ExceptFinally() calls it when an exception is not caught.  Nothing is
+ *      printed when EXCEPT_TRACE is not defined.
  *
  *  SIDE EFFECTS
- *      Decrements <numThreadsTry> when shared handlers are restored.
+ *      None.
  *
  *  RETURNS
- *      When restored 1, otherwise 0.
+ *      N/A.
  */
 
-static int ExceptRestoreHandlers(
-    Context *   pC)             /* pointer to thread exception context */
+void ExceptPrintEvents(
+    FILE *      pFile)          /* output file */
 {
-    int restored = 0;
+#ifdef  EXCEPT_TRACE
+    TraceRing * pRing;
+    TraceRing * pOldest;
+    TraceRecord record;
+    TraceRecord oldest;
+    unsigned long long  start = 0;
+    int         first = 1;
 
     EXCEPT_THREAD_MUTEX_FUNC(1);
-    if (MULTI_THREADING && SHARE_HANDLERS && --numThreadsTry == 0)
+    for (pRing = traceRings; pRing != NULL; pRing = pRing->next)
     {
-        signal(SIGABRT, sharedSigAbrtHandler);
-        signal(SIGFPE,  sharedSigFpeHandler);
-        signal(SIGILL,  sharedSigIllHandler);
-        signal(SIGSEGV, sharedSigSegvHandler);
-#ifdef  SIGBUS
-        signal(SIGBUS,  sharedSigBusHandler);
-#endif
-
-        restored = 1;
+        pRing->end = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+        pRing->cursor = pRing->end > TRACE_SIZE ? pRing->end - TRACE_SIZE : 0;
     }
-    else if (!MULTI_THREADING || !SHARE_HANDLERS)
+
+    fprintf(pFile, "Exception events, oldest first:\n");
+    fprintf(pFile, "%14s %18s %5s %-8s %-24s %s\n", "time", "thread",
+            "depth", "event", "class", "site");
+    while (1)
     {
-        signal(SIGABRT, pC->sigAbrtHandler);
-        signal(SIGFPE,  pC->sigFpeHandler);
-        signal(SIGILL,  pC->sigIllHandler);
-        signal(SIGSEGV, pC->sigSegvHandler);
-#ifdef  SIGBUS
-        signal(SIGBUS,  pC->sigBusHandler);
-#endif
+        pOldest = NULL;
+        for (pRing = traceRings; pRing != NULL; pRing = pRing->next)
+        {
+            while (pRing->cursor < pRing->end &&
+                   !ExceptTraceRead(pRing, pRing->cursor, &record))
+                pRing->cursor++;                /* overwritten */
 
-        restored = 1;
+            if (pRing->cursor < pRing->end &&
+                (pOldest == NULL || record.time < oldest.time))
+            {
+                pOldest = pRing;
+                oldest  = record;
+            }
+        }
+        if (pOldest == NULL)
+            break;
+        pOldest->cursor++;
+
+        if (first)
+            start = oldest.time;
+        first = 0;
+        ExceptPrintRecord(pFile, &oldest, start);
     }
     EXCEPT_THREAD_MUTEX_FUNC(0);
-    
-    return restored;
+#endif
 }
 
 
 /******************************************************************************
  *
- *      ExceptThreadCleanup - cleanup exception handling for ceased thread
+ *      ExceptSetInitialDepth - set initial capacity of exception handle pools
  *
  *  DESCRIPTION
- *      This routine, which is used by the except_thread_cleanup() macro,
- *      removes the exception context of the <threadId> thread from
- *      <pContextHash> and frees it.
- *
- *      It must be used after the specified thread has ceased to exist and
- *      when there is reason to assume that this thread did not perform a
- *      cleanup itself (done automatically by the outermost 'finally'); for
- *      example when it was killed.
- *
- *      In a multi-threading environment that recycles IDs, this routine must
- *      be called as soon as possible after the specified thread was stopped
- *      without executing the outermost 'fianlly'.  To prevent hazardous
- *      situations, care must be taken that no new threads are created in
- *      between stopping a thread and cleaning it up using this routine.
+ *      This routine sets the 'try' nesting depth for which the handle pool
+ *      of a context is sized when it is created; it grows beyond this when
+ *      needed.  The default is EXCEPT_INITIAL_DEPTH.  The setting applies to
+ *      pools created after the call, so it's best done once before any 'try'
+ *      is executed.  With EXCEPT_STACK_FRAMES no handles are pooled, so the
+ *      setting has no effect.
  *
  *  SIDE EFFECTS
- *      May remove a context from <pContextHash> and free it.
+ *      None.
  *
  *  RETURNS
  *      N/A.
  */
 
-void ExceptThreadCleanup(
-    int         threadId)       /* ID of ceased thread or -1 for self */
+void ExceptSetInitialDepth(
+    int         depth)          /* initial 'try' nesting capacity */
 {
-#if     MULTI_THREADING
-    validate(threadId != EXCEPT_THREAD_ID_FUNC(), NOTHING);
-    if (threadId == -1)
-        threadId = EXCEPT_THREAD_ID_FUNC();
+    validate(depth > 0, NOTHING);
 
-    EXCEPT_THREAD_MUTEX_FUNC(1);
-    if (pContextHash != NULL)
-    {
-        Context * pC;
-        
-        pC = HashLookup(pContextHash, threadId);
-        if (pC != NULL)
-        {
-            ExceptRestoreHandlers(pC);
-            LifoDestroyData(pC->exStack);
-            if (pC->pEx->checkList != NULL)
-                ListDestroyData(pC->pEx->checkList);
-            free(HashRemove(pContextHash, threadId));
-        }
-    }    
-    EXCEPT_THREAD_MUTEX_FUNC(0);
-#endif
+    initialDepth = depth;
 }
 
 
@@ -740,7 +2892,9 @@ void ExceptThreadCleanup(
  *      (for the current thread) if not there yet, installs ExceptThrowSignal() 
  *      as the signal handler for SIGABRT, SIGFPE, SIGILL, SIGSEGV and SIGBUS,
  *      and finally stores an empty/cleared handle on the exception nesting
- *      stack.
+ *      stack.  This handle is <pFrame> when the 'try' macro declares it (see
+ *      EXCEPT_STACK_FRAMES in "Except.h"), or one taken from the pool when
+ *      <pFrame> is NULL.
  *
  *      When <pC> is NULL, this is the first try in a routine.  This condition
  *      is stored to enable a ReturnEvent thrown (by the return() macro) from
@@ -748,42 +2902,111 @@ void ExceptThreadCleanup(
  *      way all finally blocks can be executed even when returned from a nested
  *      level.
  *
+ *      With EXCEPT_TRACE the 'try' is recorded in the trace ring of the
+ *      context, which the first 'try' of the context obtains.  Likewise, the
+ *      first 'try' obtains the statistics table of EXCEPT_STATS.
+ *
  *      This routine is invoked as the first action of the 'try' macro.
  *
  *  SIDE EFFECTS
  *      Signal/trap handlers are installed.
  *
  *  RETURNS
- *      N/A.
+ *      Pointer to the new current exception handle.
  */
 
-void ExceptTry(
+Except * ExceptTry(
     Context *   pC,             /* pointer to thread exception context */
+    Except *    pFrame,         /* handle declared by 'try' or NULL */
     char *      file,           /* source file name */
     int         line)           /* source line number */
 {
-    int first;
+    Except *    pEx;
+    int         first;
     
-#if     MULTI_THREADING
-    EXCEPT_THREAD_MUTEX_FUNC(1);
-    if (pContextHash == NULL)
-        pContextHash = HashCreate();
-    EXCEPT_THREAD_MUTEX_FUNC(0);
-#endif
-  
     if (first = (pC == NULL))
         pC = ExceptGetContext(NULL);
     if (pC == NULL)                     /* not needed for single-threading */
         pC = ExceptCreateContext();
+#if     defined(EXCEPT_ALT_STACK) && !MULTI_THREADING
+    if (pC->pAltStack == NULL)
+        ExceptCreateAltStack(pC);
+#endif
+#if     defined(EXCEPT_BACKTRACE) && !MULTI_THREADING
+    if (pC->pThreadStack == NULL)
+        ExceptFindStack(pC);
+#endif
   
     ExceptInstallHandlers(pC);
 
-    LifoPush(pC->exStack, pC->pEx = calloc(sizeof(Except), 1));
+    pEx = ExceptNewHandle(pC, pFrame);
+    pEx->prev = pC->pEx;
+    pC->pEx = pEx;
     pC->pEx->first = first; 
+    pC->pEx->ready = 1;
     pC->pEx->tryFile = file;
     pC->pEx->tryLine = line;
+#ifdef  EXCEPT_STATS
+    if (pC->pStats == NULL)
+        ExceptStatsAttach(pC);
+#endif
+#ifdef  EXCEPT_TRACE
+    if (pC->pTrace == NULL)
+        ExceptTraceAttach(pC);
+#endif
+    ExceptTraceEvent(pC, TRACE_TRY, NULL, file, line);
+    ExceptProbe(try, "", file, line, pC->poolStats.inUse);
     
     ExceptPrintDebug(pC, "ExceptTry");
+
+    return pEx;
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptRaise - jump to handle exception stored in current handle
+ *
+ *  DESCRIPTION
+ *      This routine does the part of a 'throw' that follows storing the
+ *      exception description in the current exception handle <pEx>: it marks
+ *      the exception pending and jumps back to the user/macro source code
+ *      for further processing.  What the macro code does after the longjmp()
+ *      depends on the context (the inner most exception block type) in which
+ *      the throw occurred.  When inside a 'try' block the scope is set to
+ *      INTERNAL, in order to go through the catch() macros code.  When inside
+ *      a 'catch' block or a 'finally' block the scope is left alone, so that
+ *      the catch() macros are skipped and the finally() macro code is
+ *      executed.
+ *
+ *  SIDE EFFECTS
+ *      Never returns because of longjmp().
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void ExceptRaise(
+    Context *   pC)             /* pointer to thread exception context */
+{
+    if (pC->pEx->onStack)
+        ExceptSetMethods(pC->pEx);
+    pC->pEx->state = PENDING;   /* in case of throw() inside 'catch' */
+    if (pC->pMessageEx == pC->pEx)
+        pC->pMessageEx = NULL;  /* <message> describes previous exception */
+
+    switch (pC->pEx->scope)
+    {
+    case TRY:
+        pC->pEx->scope = INTERNAL;      /* evaluate 'catch' clauses */
+        ExceptPrintDebug(pC, "longjmp(jumpBuf) to catch");
+        LONGJMP(pC->pEx->jumpBuf, 1);
+
+    case CATCH:
+    case FINALLY:
+        ExceptPrintDebug(pC, "longjmp(jumpBuf) to finally");
+        LONGJMP(pC->pEx->jumpBuf, 1);
+    }
 }
 
 
@@ -794,14 +3017,16 @@ void ExceptTry(
  *  DESCRIPTION
  *      This routine processes a thrown exception.
  *
- *      Throwing an exception involves copying the five arguments into the
- *      current exception handle <pEx> and subsequently jumping back to the
- *      user/macro source code for further processing.  The longjmp() depends
- *      on the context (the inner most exception block type) in which the
- *      throw occurred.  When inside a 'try' block we jump into the try() macro
- *      code in order to go through the catch() macros code.  When inside
- *      a 'catch' block or a 'finally' block a jump is done into the finally()
- *      macro code.
+ *      Throwing an exception involves copying the arguments into the current
+ *      exception handle <pEx> and subsequently jumping back to the user/macro
+ *      source code for further processing, which is done by ExceptRaise().
+ *
+ *      When an exception handle other than the current one is rethrown (e.g.,
+ *      a copy saved in an earlier 'catch', or the exception of an enclosing
+ *      'catch' rethrown from a nested 'try'), its description is copied into
+ *      the current handle.  This is the way to keep an exception beyond the
+ *      'catch' block that caught it: the handle <e> points to belongs to its
+ *      'try' statement and is reused (or goes out of scope) after 'finally'.
  *
  *      When this routine is invoked outside exception scope, it prints a
  *      message on <stderr> telling in full detail that an exception was lost.
@@ -825,40 +3050,173 @@ void ExceptThrow(
     if (pC == NULL)
         pC = ExceptGetContext(NULL);
 
-    if (pC == NULL || pC->exStack == NULL || LifoCount(pC->exStack) == 0)
+    if (pC == NULL || pC->pEx == NULL)
     {
+        ClassRef    class = pExceptOrClass;
+
+        if (!class->notRethrown)
+            class = ((Except *)pExceptOrClass)->class;
+
         fprintf(stderr, "%s lost: file \"%s\", line %d.\n",
-                ((ClassRef)pExceptOrClass)->name, file, line);
+                class->name, file, line);
+#ifdef  EXCEPT_STATS
+        {
+            ExceptInstance      instance = { class, pData, file, line };
+
+            if (!((ClassRef)pExceptOrClass)->notRethrown)
+                instance = ((Except *)pExceptOrClass)->instance;
+            ExceptCount(pC, &instance, class == pExceptOrClass ?
+                                       THROWN_EVENT : RETHROWN_EVENT);
+            ExceptCount(pC, &instance, LOST_EVENT);
+        }
+#endif
     
         return;
     }
     
-    if (((ClassRef)pExceptOrClass)->notRethrown)
+    if (!((ClassRef)pExceptOrClass)->notRethrown && pExceptOrClass != pC->pEx)
     {
-        pC->pEx->class         = (ClassRef)pExceptOrClass;
-        pC->pEx->pData         = pData;
-        pC->pEx->file          = file;
-        pC->pEx->line          = line;
-        pC->pEx->getMessage    = ExceptGetMessage;
-        pC->pEx->getData       = ExceptGetData;
-        pC->pEx->printTryTrace = ExceptPrintTryTrace;
+        pC->pEx->instance = ((Except *)pExceptOrClass)->instance;
     }
-    pC->pEx->state = PENDING;   /* in case of throw() inside 'catch' */
+    else if (((ClassRef)pExceptOrClass)->notRethrown)
+    {
+        pC->pEx->class  = (ClassRef)pExceptOrClass;
+        pC->pEx->pData  = pData;
+        pC->pEx->file   = file;
+        pC->pEx->line   = line;
+        pC->pEx->pStack = ExceptCaptureStack(pC, 1);
+    }
+    ExceptCount(pC, &pC->pEx->instance,
+                ((ClassRef)pExceptOrClass)->notRethrown ? THROWN_EVENT :
+                                                         RETHROWN_EVENT);
+    ExceptTraceEvent(pC, ((ClassRef)pExceptOrClass)->notRethrown ?
+                         TRACE_THROW : TRACE_RETHROW, pC->pEx->class,
+                     file, line);
+    if (((ClassRef)pExceptOrClass)->notRethrown)
+        ExceptProbe(throw, pC->pEx->class->name, file, line,
+                    pC->poolStats.inUse);
+    else
+        ExceptProbe(rethrow, pC->pEx->class->name, file, line,
+                    pC->poolStats.inUse);
 
-    switch (pC->pEx->scope)
+    ExceptRaise(pC);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptThrowInstance - 'throw' prebuilt exception
+ *
+ *  DESCRIPTION
+ *      This routine throws the exception described by <pInstance>, which was
+ *      defined with except_instance_define().  Its description is copied into
+ *      the current exception handle <pEx> in one go; apart from that only the
+ *      jump is left to be done (see ExceptRaise()).  The file name and line
+ *      number in the description are those of the definition.
+ *
+ *      When this routine is invoked outside exception scope, it prints a
+ *      message on <stderr> telling that an exception was lost.
+ *
+ *  SIDE EFFECTS
+ *      When called from exception scope it never returns because of longjmp().
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+void ExceptThrowInstance(
+    Context *   pC,             /* pointer to thread exception context */
+    ExceptInstance *pInstance)  /* prebuilt exception */
+{
+    ExceptPrintDebug(pC, "ExceptThrowInstance");
+
+    if (pC == NULL)
+        pC = ExceptGetContext(NULL);
+
+    if (pC == NULL || pC->pEx == NULL)
     {
-    case TRY:
-        ExceptPrintDebug(pC, "longjmp(throwBuf)");
-        LONGJMP(pC->pEx->throwBuf, 1);
+        fprintf(stderr, "%s lost: file \"%s\", line %d.\n",
+                pInstance->class->name, pInstance->file, pInstance->line);
+        ExceptCount(pC, pInstance, THROWN_EVENT);
+        ExceptCount(pC, pInstance, LOST_EVENT);
 
-    case CATCH:
-        ExceptPrintDebug(pC, "longjmp(finalBuf)");
-        LONGJMP(pC->pEx->finalBuf, 1);
+        return;
+    }
 
-    case FINALLY:
-        ExceptPrintDebug(pC, "longjmp(finalBuf)");
-        LONGJMP(pC->pEx->finalBuf, 1);
+    pC->pEx->instance = *pInstance;
+    pC->pEx->pStack = ExceptCaptureStack(pC, 1);
+    ExceptCount(pC, pInstance, THROWN_EVENT);
+    ExceptTraceEvent(pC, TRACE_THROW, pInstance->class, pInstance->file,
+                     pInstance->line);
+    ExceptProbe(throw, pInstance->class->name, pInstance->file,
+                pInstance->line, pC->poolStats.inUse);
+
+    ExceptRaise(pC);
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptClassDepth - get depth of class in hierarchy
+ *
+ *  DESCRIPTION
+ *      This routine returns the depth of <class>: 1 for a root class (like
+ *      Throwable), 2 for its children, and so on.  The first time it is
+ *      called for a class, the depth and the 'display' of the class are
+ *      determined: an array with the class' ancestors indexed by depth,
+ *      ending with the class itself.  The class definitions (done with
+ *      except_class_define()) are static initializers, which can't contain
+ *      these values; so they are calculated at first use.
+ *
+ *      The displays are taken from the static <displays>, so that nothing is
+ *      allocated; this may happen in a signal handler.  When <displays> is
+ *      full, the class gets no display (see ExceptIsDerived()).
+ *
+ *      More threads may do this at the same time.  Only one display gets
+ *      stored; the slots of the others stay unused.  The depth is stored
+ *      last, so that a non-zero depth means that the display is complete.  A
+ *      thread that finds a display stored by another one acquires it before
+ *      storing the depth, so that the display is complete for every thread
+ *      that sees this depth too.
+ *
+ *  SIDE EFFECTS
+ *      Takes slots of <displays> (once).
+ *
+ *  RETURNS
+ *      Class depth.
+ */
+
+static int ExceptClassDepth(
+    ClassRef    class)  /* class being considered */
+{
+    ClassRef *  display;
+    ClassRef *  expected = NULL;
+    ClassRef    ancestor;
+    int         depth;
+    int         index;
+
+    depth = __atomic_load_n(&class->depth, __ATOMIC_ACQUIRE);
+    if (depth > 0)
+        return depth;
+
+    if (class->parent == NULL)
+        depth = 1;
+    else
+        depth = ExceptClassDepth(class->parent) + 1;
+
+    index = __atomic_fetch_add(&displaysUsed, depth, __ATOMIC_RELAXED);
+    if (index <= DISPLAY_SLOTS - depth)
+    {
+        display = &displays[index];
+        index   = depth;
+        for (ancestor = class; ancestor != NULL; ancestor = ancestor->parent)
+            display[--index] = ancestor;
+        __atomic_compare_exchange_n(&class->display, &expected, display, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
     }
+    __atomic_store_n(&class->depth, depth, __ATOMIC_RELEASE);
+
+    return depth;
 }
 
 
@@ -870,6 +3228,12 @@ void ExceptThrow(
  *      This routine determines if <class> is derived from <base> or is
  *      identical.
  *
+ *      Instead of walking up the parent chain, the display of <class> is
+ *      used (see ExceptClassDepth()): <base> is an ancestor of <class> when
+ *      it is not deeper, and found in the display of <class> at its own depth.
+ *      Only a class without display (when there was no room for it) is
+ *      walked up to the depth of <base>.
+ *
  *  SIDE EFFECTS
  *      None.
  *
@@ -881,7 +3245,16 @@ static int ExceptIsDerived(
     ClassRef    class,  /* class being considered */
     ClassRef    base)   /* base class */
 {
-    while (class->parent != NULL && class != base)
+    int         depth = ExceptClassDepth(base);
+    int         classDepth = ExceptClassDepth(class);
+    ClassRef *  display = __atomic_load_n(&class->display, __ATOMIC_ACQUIRE);
+
+    if (depth > classDepth)
+        return 0;
+    if (display != NULL)
+        return display[depth - 1] == base;
+
+    for (; classDepth > depth; classDepth--)
         class = class->parent;
 
     return class == base;
@@ -896,10 +3269,12 @@ static int ExceptIsDerived(
  *      This routine checks if the currently occurred exception <pC->pEx>
  *      matches <id>.  It is invoked for each subsequent 'catch' clause.
  *
- *      It is called from the 'catch' macro.
+ *      It is called from the 'catch' macro, except when <pCache> of the
+ *      clause already tells that the thrown class does not match.  When the
+ *      cache tells that it matches, the class hierarchy is not checked.
  *
  *  SIDE EFFECTS
- *      None.
+ *      The result for the thrown class is stored in <pCache>, if not NULL.
  *
  *  RETURNS
  *      When the current exception was matched 1, or otherwise 0.
@@ -907,15 +3282,43 @@ static int ExceptIsDerived(
 
 int ExceptCatch(
     Context *   pC,             /* pointer to thread exception context */
-    ClassRef    class)          /* pointer to occurred exception */
+    ClassRef    class,          /* pointer to occurred exception */
+    uintptr_t * pCache)         /* 'catch' clause cache word, or NULL */
 {
+    uintptr_t   thrown;
+
     ExceptPrintDebug(pC, "ExceptCatch");
 
     if (pC == NULL)
         pC = ExceptGetContext(NULL);
 
-    if (pC->pEx->state == PENDING && ExceptIsDerived(pC->pEx->class, class))
-        pC->pEx->state = CAUGHT;
+    thrown = (uintptr_t)pC->pEx->class;
+    if (pC->pEx->state == PENDING)
+    {
+        if (pCache != NULL &&
+            __atomic_load_n(pCache, __ATOMIC_RELAXED) == (thrown | 1))
+        {
+            pC->pEx->state = CAUGHT;
+        }
+        else
+        {
+            if (ExceptIsDerived(pC->pEx->class, class))
+            {
+                pC->pEx->state = CAUGHT;
+                thrown |= 1;
+            }
+            if (pCache != NULL)
+                __atomic_store_n(pCache, thrown, __ATOMIC_RELAXED);
+        }
+        if (pC->pEx->state == CAUGHT)
+        {
+            ExceptCount(pC, &pC->pEx->instance, CAUGHT_EVENT);
+            ExceptTraceEvent(pC, TRACE_CATCH, pC->pEx->class, pC->pEx->file,
+                             pC->pEx->line);
+            ExceptProbe(catch, pC->pEx->class->name, pC->pEx->file,
+                        pC->pEx->line, pC->poolStats.inUse);
+        }
+    }
 
     return pC->pEx->state == CAUGHT;
 }
@@ -935,15 +3338,20 @@ int ExceptCatch(
  *      "README" are met).  If the just popped exception was not caught, the
  *      default action (i.e., outside this package) is performed when the stack
  *      became empty; when the stack is not empty yet, the exception is propa-
- *      gated by doing a new trow.
+ *      gated by raising it again in the enclosing handle (which is not counted
+ *      as a throw by EXCEPT_STATS).
  *
  *      When there is a pending 'return', a longjmp() is done to the macro code
  *      that performs the actual return.
  *
- *      In all cases the popped exception handle is freed.  For multi-threading
- *      The exception context of the current thread is removed from the hash
- *      table <pContextHash> and freed, when this is the outermost 'finally'
- *      (i.e., when <pC->exStack> became empty).
+ *      When EXCEPT_TRACE is defined, the events of all threads are dumped on
+ *      <stderr> (see ExceptPrintEvents()) when an exception was not caught.
+ *
+ *      In all cases the popped exception handle is put back in the pool.  For
+ *      multi-threading the exception context of the current thread is removed
+ *      from the hash table <pContextHash> and freed, when this is the
+ *      outermost 'finally' (i.e., when the stack became empty) and the
+ *      context is not kept until the thread terminates.
  *
  *      The return value of this routine is used as stop condition in one of
  *      the while-loops of the 'finally' macro code, and must always be zero. 
@@ -964,16 +3372,28 @@ int ExceptFinally(
     if (pC == NULL)
         pC = ExceptGetContext(NULL);
 
-    ex = *(pEx = LifoPop(pC->exStack));
-    free(pEx);
-    pC->pEx = LifoCount(pC->exStack) ? LifoPeek(pC->exStack, 1) : NULL;
+    ex = *(pEx = pC->pEx);
+    ExceptTraceEvent(pC, TRACE_FINALLY, ex.state == PENDING ? ex.class : NULL,
+                     ex.tryFile, ex.tryLine);
+    ExceptProbe(finally, ex.state == PENDING ? ex.class->name : "",
+                ex.tryFile, ex.tryLine, pC->poolStats.inUse);
+    pC->pEx = pEx->prev;
+    ExceptFreeHandle(pC, pEx);
 
-    if (LifoCount(pC->exStack) == 0)
+    if (pC->pEx == NULL)
     {
         /* outermost level - default action */
 
         int     restored = ExceptRestoreHandlers(pC);
 
+        if (ex.state == PENDING && ex.class != ReturnEvent)
+        {
+            ExceptCount(pC, &ex.instance, LOST_EVENT);
+#ifdef  EXCEPT_TRACE
+            ExceptPrintEvents(stderr);
+#endif
+        }
+
         if (ex.state == PENDING)
         {
             if (ex.class == FailedAssertion)
@@ -982,51 +3402,19 @@ int ExceptFinally(
             }
             else if (ExceptIsDerived(ex.class, RuntimeException) && restored)
             {
-                LifoDestroy(pC->exStack);
-                if (MULTI_THREADING)
-                {
-                    EXCEPT_THREAD_MUTEX_FUNC(1);
-                    free(HashRemove(pContextHash, EXCEPT_THREAD_ID_FUNC()));
-                    EXCEPT_THREAD_MUTEX_FUNC(0);
-                }
-                else
-                {
-                    pC->exStack = NULL;
-                }
-             
+                ExceptReleaseContext(pC);
                 raise(ex.class->signalNumber);
             }
             else if (ex.class == ReturnEvent)
             {
-                LifoDestroy(pC->exStack);
-                if (MULTI_THREADING)
-                {
-                    EXCEPT_THREAD_MUTEX_FUNC(1);
-                    free(HashRemove(pContextHash, EXCEPT_THREAD_ID_FUNC()));
-                    EXCEPT_THREAD_MUTEX_FUNC(0);
-                }
-                else
-                {
-                    pC->exStack = NULL;
-                }
-                
-                LONGJMP(*(JMP_BUF *)ex.pData, 1);
+                ExceptReleaseContext(pC);
+                LONGJMP(ex.returnBuf, 1);
             }
             else
                 fprintf(stderr, "%s lost: file \"%s\", line %d.\n",
                         ex.class->name, ex.file, ex.line);
         }
-        LifoDestroy(pC->exStack);
-        if (MULTI_THREADING)
-        {
-            EXCEPT_THREAD_MUTEX_FUNC(1);
-            free(HashRemove(pContextHash, EXCEPT_THREAD_ID_FUNC()));
-            EXCEPT_THREAD_MUTEX_FUNC(0);
-        }
-        else
-        {
-            pC->exStack = NULL;
-        }
+        ExceptReleaseContext(pC);
     }
     else     
     {
@@ -1036,11 +3424,12 @@ int ExceptFinally(
         {
             if (ex.class == ReturnEvent && ex.first)
             {            
-                LONGJMP(*(JMP_BUF *)ex.pData, 1);    /* pData is returnBuf */
+                LONGJMP(ex.returnBuf, 1);
             }
             else
             {
-                ExceptThrow(pC, ex.class, ex.pData, ex.file, ex.line);
+                pC->pEx->instance = ex.instance;    /* not a new throw */
+                ExceptRaise(pC);
             }
         }
     }
@@ -1077,9 +3466,9 @@ void ExceptReturn(
 
     pC->pEx->class = ReturnEvent;       /* may overrule pending exception */
     pC->pEx->state = PENDING;           /* in case of return() inside 'catch' */
-    ExceptPrintDebug(pC, "longjmp(finalBuf)");
+    ExceptPrintDebug(pC, "longjmp(jumpBuf) to finally");
         
-    LONGJMP(pC->pEx->finalBuf, 1);
+    LONGJMP(pC->pEx->jumpBuf, 1);       /* scope is not INTERNAL */
 }
 
 
@@ -1089,16 +3478,22 @@ void ExceptReturn(
  *
  *  DESCRIPTION
  *      This routine is called during DEBUG for each 'try' statement, just 
- *      before and after the 'catch' conditions are checked.  When called the
- *      first time, it creates a list in which all 'catch' conditions will
- *      be stored and which will be used for checking.  The second time, this
- *      routine performs the final test: check if there were any 'catch'
- *      clauses; subsequently the list is destroyed again.
+ *      before and after the 'catch' conditions are checked, until the 'catch'
+ *      conditions of the 'try' have been checked once.  When called the first
+ *      time, it claims the static table <pTable> of the 'try' in which all
+ *      'catch' conditions will be stored and which will be used for checking.
+ *      The second time, this routine performs the final test: check if there
+ *      were any 'catch' clauses; subsequently <pTable> is marked as checked,
+ *      after which the macro code no longer calls this routine.
+ *
+ *      The mutex is held from the first to the second call, so that only one
+ *      thread checks the 'catch' clauses of a 'try'.  No user code is run in
+ *      between.  A thread that has to wait for it, finds the table checked.
  *
  *      The return value influences the control flow of the macro code.
  *
  *  SIDE EFFECTS
- *      None.
+ *      Locks (first time) or unlocks (second time) the mutex.
  *
  *  RETURNS
  *      First time called 0, or 1 the second time (i.e., when checked).
@@ -1106,34 +3501,73 @@ void ExceptReturn(
 
 int ExceptCheckBegin(
     Context *   pC,             /* pointer to thread exception context */
-    int *       pChecked,       /* pointer to flag if finished checking */
+    CheckTable *pTable,         /* pointer to 'catch' check table of 'try' */
     char *      file,           /* name of source file where invoked */
     int         line)           /* source file line number */
 {
     ExceptPrintDebug(pC, "ExceptCheckBegin");
 
-    if (pC->pEx->checkList == NULL && !*pChecked)
+    if (__atomic_load_n(&pTable->pOwner, __ATOMIC_RELAXED) != pC)
     {
-        pC->pEx->checkList = ListCreate();
+        EXCEPT_THREAD_MUTEX_FUNC(1);
+        if (pTable->checked)
+        {
+            EXCEPT_THREAD_MUTEX_FUNC(0);
+
+            return 1;
+        }
+        __atomic_store_n(&pTable->pOwner, pC, __ATOMIC_RELAXED);
+
+        return 0;
     }
     else
     {
-        if (!*pChecked)
+        if (pTable->count == 0)
         {
-            if (ListCount(pC->pEx->checkList) == 0)
-            {
-                fprintf(stderr,
-                        "Warning: No catch clause(s): file \"%s\", line %d.\n",
-                        file, line);
-            }
-
-            ListDestroyData(pC->pEx->checkList);
-            pC->pEx->checkList = NULL;
-            *pChecked = 1;
+            fprintf(stderr,
+                    "Warning: No catch clause(s): file \"%s\", line %d.\n",
+                    file, line);
         }
+
+        __atomic_store_n(&pTable->pOwner, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&pTable->checked, 1, __ATOMIC_RELEASE);
+        EXCEPT_THREAD_MUTEX_FUNC(0);
+
+        return 1;
+    }
+}
+
+
+/******************************************************************************
+ *
+ *      ExceptCheckSlot - find 'catch' check table slot of class
+ *
+ *  DESCRIPTION
+ *      This routine looks up <class> in the open addressing hash table of
+ *      'catch' conditions <pTable>, using linear probing.  The table always
+ *      has an empty slot, so the search ends.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to the slot holding <class>, or to the empty slot where it
+ *      would have to be stored.
+ */
+
+static CheckSlot * ExceptCheckSlot(
+    CheckTable *pTable,         /* pointer to 'catch' check table of 'try' */
+    ClassRef    class)          /* exception class to look up */
+{
+    int         index = ((uintptr_t)class >> 4) & (EXCEPT_CHECK_SLOTS - 1);
+
+    while (pTable->slots[index].class != NULL &&
+           pTable->slots[index].class != class)
+    {
+        index = (index + 1) & (EXCEPT_CHECK_SLOTS - 1);
     }
 
-    return *pChecked;
+    return &pTable->slots[index];
 }
 
 
@@ -1144,9 +3578,16 @@ int ExceptCheckBegin(
  *  DESCRIPTION
  *      This routine is called during DEBUG for each 'catch' clause and does
  *      all tests (described in "README") using the conditions of the previous
- *      'catch' clauses, that are stored in <pC->pEx->checkList>.  When a test
- *      fails a message is printed on <stderr>.  After all tests have been
- *      performed, the current 'catch' condition is added to the list.
+ *      'catch' clauses, that are stored in <pTable>.  When a test fails a
+ *      message is printed on <stderr>.  After all tests have been performed,
+ *      the current 'catch' condition is added to the table.
+ *
+ *      Instead of comparing with each previous 'catch' condition, the class
+ *      and its ancestors are looked up in the table.  An ancestor that is
+ *      found makes the 'catch' superfluous; the nearest one is reported,
+ *      which is the first one in clause order (a later ancestor would have
+ *      been superfluous).  When the table is full, further classes are not
+ *      stored and are thus not checked against.
  *
  *      It is, for the filename in the message, assumed that all 'catch'
  *      clauses belonging to a 'try' statement are all in the same file.
@@ -1157,59 +3598,54 @@ int ExceptCheckBegin(
  *      None.
  *
  *  RETURNS
- *      When testing finished 1 (refer to ExceptCheckBegin()), or 0.
+ *      0, because it is only called while checking (refer to
+ *      ExceptCheckBegin()).
  */
 
 int ExceptCheck(
     Context *   pC,             /* pointer to thread exception context */
-    int *       pChecked,       /* pointer to flag if finished checking */
+    CheckTable *pTable,         /* pointer to 'catch' check table of 'try' */
     ClassRef    class,          /* next exception class to be checked */
     char *      file,           /* name of source file where invoked */
     int         line)           /* source file line number */
 {
-    typedef struct _Check
-    {
-        ClassRef        class;
-        int             line;
-    } Check;
+    CheckSlot * pSlot;
+    CheckSlot * pAncestorSlot;
+    ClassRef    ancestor;
 
     ExceptPrintDebug(pC, "ExceptCheck");
 
-    if (!*pChecked)
+    pSlot = ExceptCheckSlot(pTable, class);
+    if (pSlot->class == class)
     {
-        Check * pCheck;
+        fprintf(stderr, "Duplicate catch(%s): file \"%s\", line %d; "
+                "already caught at line %d.\n",
+                class->name, file, line, pSlot->line);
 
-        pCheck = ListHead(pC->pEx->checkList);
-        while (pCheck != NULL)                  /* breaked from */
-        {
-            if (class == pCheck->class)
-            {
-                fprintf(stderr, "Duplicate catch(%s): file \"%s\", line %d; "
-                        "already caught at line %d.\n",
-                        class->name, file, line, pCheck->line);
-                break;
-            }
+        return 0;
+    }
 
-            if (ExceptIsDerived(class, pCheck->class))
-            {
-                fprintf(stderr, "Superfluous catch(%s): file \"%s\", line %d; "
-                        "already caught by %s at line %d.\n", class->name,
-                        file, line, pCheck->class->name, pCheck->line);
-                break;
-            }
+    for (ancestor = class->parent; ancestor != NULL; ancestor = ancestor->parent)
+    {
+        pAncestorSlot = ExceptCheckSlot(pTable, ancestor);
+        if (pAncestorSlot->class == ancestor)
+        {
+            fprintf(stderr, "Superfluous catch(%s): file \"%s\", line %d; "
+                    "already caught by %s at line %d.\n", class->name,
+                    file, line, ancestor->name, pAncestorSlot->line);
 
-            pCheck = ListNext(pC->pEx->checkList);
+            return 0;
         }
+    }
 
-        if (pCheck == NULL)
-        {
-            pCheck = malloc(sizeof(Check));
-            pCheck->class = class;
-            pCheck->line  = line;
-            ListAddTail(pC->pEx->checkList, pCheck);
-        }
+    if (pTable->count < EXCEPT_CHECK_SLOTS - 1)
+    {
+        pSlot->class = class;
+        pSlot->line  = line;
+        pTable->count++;
     }
-    return *pChecked;
+
+    return 0;
 }
 
 
@@ -9,32 +9,37 @@
  *      A 'try' starts a while-loop that end in its mandatory 'finally'.  This
  *      loop encloses zero or more 'catches'.  When no 'catch' checking is
  *      performed (i.e., when DEBUG is not defined), this loop is executed
- *      twice.  In the first pass the <throwBuf> and <finalBuf> longjmp()
- *      destinations of the current exception object <pC->pEx> are saved; no
- *      user code is executed.  This is controlled by the flag <pC->pEx->ready> 
- *      which is initially zero and is set to one at the end of the first pass.
- *      When DEBUG is defined an early pass is added which checks the 'catch' 
- *      conditions; nothing else happens during this pass.
+ *      once.  When DEBUG is defined an early pass is added which checks the
+ *      'catch' conditions; nothing else happens during this pass.
  *
- *      In the final pass (i.e., the second or third, depending on DEBUG), the
- *      user code in the 'try' block is executed (<pC->pEx->ready> is 1 by
- *      then).  If no exception occurs the 'catch' clauses are fully skipped
- *      and the 'break' halfway 'finally' is executed.  If however an exception
- *      occurred, a longjmp() to <pC->pEx->throwBuf> is performed (by the code
- *      in "Except.c").  Because "setjmp(pC->pEx->throwBuf) == 0" in 'try' is
- *      false, the "else if()" statement for each 'catch' are executed one by
- *      one until a match takes place, causing ExceptCatch() to return 1.
- *      After catching, the 'break' is also executed.
+ *      In the final pass the single longjmp() destination <jumpBuf> of the
+ *      current exception object <pC->pEx> is saved, and the user code in the
+ *      'try' block is executed.  If no exception occurs the 'catch' clauses
+ *      are fully skipped and the 'break' halfway 'finally' is executed.  If
+ *      however an exception occurred, a longjmp() to <pC->pEx->jumpBuf> is
+ *      performed (by the code in "Except.c").  Because "setjmp() == 0" in
+ *      'try' is then false, the "else if()" statement for each 'catch' is
+ *      evaluated.  What happens next is routed by <pC->pEx->scope>: only when
+ *      the exception was thrown in the 'try' block, ExceptThrow() has set it
+ *      to INTERNAL and the 'catch' clauses are evaluated one by one until a
+ *      match takes place, causing ExceptCatch() to return 1.  In all other
+ *      cases (a 'throw' inside 'catch' or 'finally' or a return()), the scope
+ *      is left as it was so all 'catch' clauses are skipped.  After catching,
+ *      or when nothing was caught, the 'break' is also executed.
  *
  *      Finally, the two nested while-statements are executed.  At the start,
- *      <pC->pEx->ready> is still 1 and thus greater than 0, so the inner
- *      while-statement will be excecuted; ExceptFinally() is not invoked yet.
- *      In the inner while-statement <pC->pEx->ready> is found to be greater 
- *      than 0, so the user [compound] statement below will be executed; but
- *      first <pC->pEx->ready> is decremented and becomes 0.  After the user 
- *      code is executed, the condition of the outer while-statement is again
- *      evaluated.  This time ExceptFinally() is invoked and always returns 0,
- *      this ends the current exception handling level.
+ *      <pC->pEx->ready> is 1 (set by ExceptTry()) and thus greater than 0, so
+ *      the inner while-statement will be excecuted; ExceptFinally() is not
+ *      invoked yet.  In the inner while-statement <pC->pEx->ready> is found to
+ *      be greater than 0, so the user [compound] statement below will be
+ *      executed; but first <pC->pEx->ready> is decremented and becomes 0.
+ *      After the user code is executed, the condition of the outer while-
+ *      statement is again evaluated.  This time ExceptFinally() is invoked
+ *      and always returns 0, this ends the current exception handling level.
+ *      When an exception is thrown inside the 'finally' block, the longjmp()
+ *      to <jumpBuf> leads to the same while-statements again; because
+ *      <pC->pEx->ready> is then 0, the 'finally' block is not executed again
+ *      but ExceptFinally() is invoked directly.
  *
  *  REMARKS
  *      The "do { } while (0);" are placed around the 'try' and 'catch' user
@@ -52,6 +57,31 @@
  *      Most conditions in the macro code depend on ANSI C's left-to-right
  *      lazy boolean expression evaluation.
  *
+ *      Each 'try' has a static <catchCache> with one word per 'catch' clause
+ *      (up to EXCEPT_CATCH_CACHE clauses), counted by <catchClause>.  The word
+ *      holds the class last thrown past the clause, with the low bit set when
+ *      the clause matched it.  When the same class is thrown again, a clause
+ *      that did not match is skipped with a single compare in the macro code,
+ *      and one that did match is caught by ExceptCatch() without looking at
+ *      the class hierarchy.  A word always holds a complete class/result pair,
+ *      so threads sharing the cache can at worst cause a cache miss.
+ *
+ *      When EXCEPT_STACK_FRAMES is defined the exception object is not taken
+ *      from the pool but declared by 'try' as <exFrame>.  Because it must
+ *      stay in scope up to and including the 'finally' block, the whole
+ *      statement is wrapped in a for-loop: its initialization declares the
+ *      object and invokes ExceptTry(), an if-statement selects between the
+ *      while-loop described above and the 'finally' block, and the for-loop
+ *      condition plays the role of the outer 'finally' while-statement.  The
+ *      for-loop increment sets the FINALLY scope after each pass.  Since the
+ *      object is gone after 'finally', ExceptThrow() copies an exception
+ *      that is rethrown from elsewhere into the current object.
+ *
+ *      By default the setjmp() call saves the signal mask, which costs a system
+ *      call for each 'try'.  When EXCEPT_NO_SIGMASK is defined the mask is
+ *      not saved (and not restored by longjmp()); instead ExceptThrowSignal()
+ *      unblocks the signal it is handling before it throws.
+ *
  *      The reason why the setjmp() calls need to be placed in macros, is that
  *      (according to the C standard) a longjmp() may only be done to a still
  *      existing stack frame.   
@@ -81,16 +111,37 @@
 #define _EXCEPT_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
 #include <setjmp.h>
 #include "Lifo.h"
 #include "List.h"
 
+#ifdef  EXCEPT_NO_SIGMASK
+#define SETJMP(env)             sigsetjmp(env, 0)
+#else
 #define SETJMP(env)             sigsetjmp(env, 1)
+#endif
 #define LONGJMP(env, val)       siglongjmp(env, val)
 #define JMP_BUF                 sigjmp_buf
 
+#ifndef EXCEPT_CATCH_CACHE
+#define EXCEPT_CATCH_CACHE      8       /* cached 'catch' clauses per 'try' */
+#endif
+
+#ifndef EXCEPT_CHECK_SLOTS
+#define EXCEPT_CHECK_SLOTS      32      /* 'catch' check table size (2^n) */
+#endif
+
+#ifndef EXCEPT_BACKTRACE_DEPTH
+#define EXCEPT_BACKTRACE_DEPTH  16      /* return addresses per stack */
+#endif
+
+#ifndef EXCEPT_STATS_SLOTS
+#define EXCEPT_STATS_SLOTS      256     /* throw site table size (2^n) */
+#endif
+
 
 typedef void (* Handler)(int);
 
@@ -101,6 +152,8 @@ struct _Class
     ClassRef    parent;                 /* parent class */
     char *      name;                   /* this class name string */
     int         signalNumber;           /* optional signal number */
+    int         depth;                  /* ancestors + 1 (0: not known yet) */
+    ClassRef *  display;                /* ancestors by depth, self last */
 };
 
 typedef struct _Class Class[1];         /* exception class */
@@ -121,39 +174,136 @@ typedef enum _State                     /* exception handling state */
     CAUGHT                              /* occurred exception caught */
 } State;
 
+typedef struct _StackTrace              /* interned call stack */
+{
+    int         state;                  /* slot empty, being filled or set */
+    int         depth;                  /* number of return addresses */
+    uintptr_t   hash;                   /* hash of <frames> */
+    void *      frames[EXCEPT_BACKTRACE_DEPTH];     /* innermost first */
+} StackTrace;
+
+typedef struct _ExceptInstance          /* prebuilt exception */
+{
+    ClassRef    class;                  /* exception class */
+    void *      pData;                  /* exception associated (user) data */
+    char *      file;                   /* file name of definition */
+    int         line;                   /* line number of definition */
+    StackTrace *pStack;                 /* stack of throw (set by throw) */
+} ExceptInstance;
+
 typedef struct _Except                  /* exception handle */
 {
     int         notRethrown;            /* always 0 (used by throw()) */
     State       state;                  /* current state of this handle */
-    JMP_BUF     throwBuf;               /* start-'catching' destination */
-    JMP_BUF     finalBuf;               /* perform-'finally' destination */
-    ClassRef    class;                  /* occurred exception class */
-    void *      pData;                  /* exception associated (user) data */
-    char *      file;                   /* exception file name */
-    int         line;                   /* exception line number */
+    union
+    {
+        struct
+        {
+            ClassRef    class;          /* occurred exception class */
+            void *      pData;          /* exception associated (user) data */
+            char *      file;           /* exception file name */
+            int         line;           /* exception line number */
+            StackTrace *pStack;         /* stack of throw or NULL */
+        };
+        ExceptInstance  instance;       /* all of the above at once */
+    };
     int         ready;                  /* macro code control flow flag */
     Scope       scope;                  /* exception handling scope */
     int         first;                  /* flag if first try in function */
-    List *      checkList;              /* list used by 'catch' checking */
+    struct _Except *prev;               /* handle of enclosing 'try' */
+    int         onStack;                /* declared by 'try' (not pooled) */
     char*       tryFile;                /* source file name of 'try' */
     int         tryLine;                /* source line number of 'try' */
 
+    JMP_BUF     jumpBuf;                /* 'catch'/'finally' destination */
+    JMP_BUF     returnBuf;              /* return() destination */
+
     ClassRef    (*getClass)(void);      /* method returning class reference */
     char *      (*getMessage)(void);    /* method getting description */
+    char *      (*formatMessage)(char *, size_t);   /* idem. into buffer */
     void *      (*getData)(void);       /* method getting application data */
     void        (*printTryTrace)(FILE*);/* method printing nested trace */
 } Except;
 
+typedef struct _CheckSlot               /* checked 'catch' clause */
+{
+    ClassRef    class;                  /* class caught by clause */
+    int         line;                   /* source line number of clause */
+} CheckSlot;
+
+typedef struct _CheckTable              /* 'catch' checking of one 'try' */
+{
+    int         checked;                /* flag if finished checking */
+    int         count;                  /* number of classes in <slots> */
+    void *      pOwner;                 /* context of thread checking */
+    CheckSlot   slots[EXCEPT_CHECK_SLOTS];  /* hashed by class */
+} CheckTable;
+
+typedef struct _PoolStats               /* exception handle pool counters */
+{
+    int         inUse;                  /* handles currently in use */
+    int         allocated;              /* handles allocated (used + free) */
+    int         highWater;              /* maximum number in use at once */
+} PoolStats;
+
+typedef struct _MutexStats              /* shared data mutex counters */
+{
+    unsigned long       acquisitions;   /* number of times locked */
+    unsigned long       contended;      /* locks that had to wait */
+    unsigned long long  waitNs;         /* total wait time in nanoseconds */
+} MutexStats;
+
+typedef struct _SiteStats               /* counters of one throw site */
+{
+    ClassRef    class;                  /* exception class thrown */
+    char *      file;                   /* file name of 'throw' */
+    int         line;                   /* line number of 'throw' */
+    unsigned long       thrown;         /* number of times thrown */
+    unsigned long       caught;         /* number of times caught */
+    unsigned long       lost;           /* not caught by outermost 'try' */
+    unsigned long       rethrown;       /* number of times rethrown */
+} SiteStats;
+
+typedef enum _TraceEvent                /* traced exception handling event */
+{
+    TRACE_TRY,                          /* 'try' entered */
+    TRACE_THROW,                        /* exception thrown */
+    TRACE_CATCH,                        /* exception caught */
+    TRACE_FINALLY,                      /* 'finally' finished */
+    TRACE_RETHROW,                      /* exception rethrown */
+    TRACE_SIGNAL                        /* signal turned into exception */
+} TraceEvent;
+
+typedef struct _TraceRecord             /* traced event */
+{
+    unsigned long long  time;           /* time stamp (counter) */
+    uintptr_t   threadId;               /* thread ID (0: single-threaded) */
+    ClassRef    class;                  /* exception class or NULL */
+    char *      file;                   /* file name of event */
+    int         line;                   /* line number of event */
+    short       depth;                  /* 'try' nesting depth */
+    char        event;                  /* TraceEvent */
+} TraceRecord;
+
 typedef struct _Context                 /* exception context per thread */
 {
-    Except *    pEx;                    /* current exception handle */
-    Lifo *      exStack;                /* exception handle stack */
+    Except *    pEx;                    /* current (innermost) handle */
+    Lifo *      exPool;                 /* free exception handles */
+    PoolStats   poolStats;              /* exception handle pool counters */
     char        message[1024];          /* used by ExceptGetMessage() */
+    Except *    pMessageEx;             /* handle described by <message> */
+#ifndef EXCEPT_SIGACTION
     Handler     sigAbrtHandler;         /* default SIGABRT handler */
     Handler     sigFpeHandler;          /* default SIGFPE handler */
     Handler     sigIllHandler;          /* default SIGILL handler */
     Handler     sigSegvHandler;         /* default SIGSEGV handler */
     Handler     sigBusHandler;          /* default SIGBUS handler */
+#endif
+    void *      pAltStack;              /* alternate signal stack or NULL */
+    void *      pThreadStack;           /* lowest address of thread stack */
+    size_t      threadStackSize;        /* its size or 0 when unknown */
+    struct _StatsTable *pStats;         /* throw site counters or NULL */
+    struct _TraceRing *pTrace;          /* recent events or NULL */
 } Context;
 
 extern Context *        pC;
@@ -162,6 +312,9 @@ extern Class            Throwable;
 #define except_class_declare(child, parent) extern Class child
 #define except_class_define(child, parent)  Class child = { 1, parent, #child }
 
+#define except_instance_define(name, class, pData)                      \
+    ExceptInstance name = { class, pData, __FILE__, __LINE__ }
+
 except_class_declare(Exception,           Throwable);
 except_class_declare(OutOfMemoryError,    Exception);
 except_class_declare(FailedAssertion,     Exception);
@@ -176,22 +329,26 @@ except_class_declare(BusError,            RuntimeException);  /* SIGBUS */
 #ifdef  DEBUG
 
 #define CHECKED                                                         \
-        static int checked
+        static CheckTable checked
 
-#define CHECK_BEGIN(pC, pChecked, file, line)                           \
-            ExceptCheckBegin(pC, pChecked, file, line)
+#define CHECK_DONE(pTable)                                              \
+    __atomic_load_n(&(pTable)->checked, __ATOMIC_ACQUIRE)
 
-#define CHECK(pC, pChecked, class, file, line)                          \
-                 ExceptCheck(pC, pChecked, class, file, line)
+#define CHECK_BEGIN(pC, pTable, file, line)                             \
+            (CHECK_DONE(pTable) || ExceptCheckBegin(pC, pTable, file, line))
+
+#define CHECK(pC, pTable, class, file, line)                            \
+                 (CHECK_DONE(pTable) ||                                 \
+                  ExceptCheck(pC, pTable, class, file, line))
 
 #define CHECK_END                                                       \
-            !checked
+            !CHECK_DONE(&checked)
 
 #else   /* DEBUG */
 
 #define CHECKED
-#define CHECK_BEGIN(pC, pChecked, file, line)           1
-#define CHECK(pC, pChecked, class, file, line)          1
+#define CHECK_BEGIN(pC, pTable, file, line)             1
+#define CHECK(pC, pTable, class, file, line)            1
 #define CHECK_END                                       0
 
 #endif  /* DEBUG */
@@ -199,80 +356,140 @@ except_class_declare(BusError,            RuntimeException);  /* SIGBUS */
 
 #define except_thread_cleanup(id)       ExceptThreadCleanup(id)
 
-#define try                                                             \
-    ExceptTry(pC, __FILE__, __LINE__);                                  \
+#define CATCH_CACHE                                                     \
+        static uintptr_t catchCache[EXCEPT_CATCH_CACHE];                \
+        int             catchClause = 0
+
+#define CATCH_MATCH(pC, clause)                                         \
+    (++catchClause <= EXCEPT_CATCH_CACHE &&                             \
+     __atomic_load_n(&catchCache[catchClause - 1], __ATOMIC_RELAXED) == \
+     (uintptr_t)pC->pEx->class ? 0 :                                    \
+     ExceptCatch(pC, clause, catchClause <= EXCEPT_CATCH_CACHE ?        \
+                            &catchCache[catchClause - 1] : NULL))
+
+#define TRY_LOOP                                                        \
     while (1)                                                           \
     {                                                                   \
         Context *       pTmpC = ExceptGetContext(pC);                   \
         Context *       pC = pTmpC;                                     \
+        CATCH_CACHE;                                                    \
         CHECKED;                                                        \
                                                                         \
         if (CHECK_BEGIN(pC, &checked, __FILE__, __LINE__) &&            \
-            pC->pEx->ready && SETJMP(pC->pEx->throwBuf) == 0)           \
+            SETJMP(pC->pEx->jumpBuf) == 0)                              \
         {                                                               \
             pC->pEx->scope = TRY;                                       \
             do                                                          \
             {
 
+#define FINALLY_LOOP_END                                                \
+            }                                                           \
+            while (0);                                                  \
+        }                                                               \
+        if (CHECK_END)                                                  \
+            continue;                                                   \
+        break;                                                          \
+    }
+
+#ifdef  EXCEPT_STACK_FRAMES
+
+#define try                                                             \
+    for (Except exFrame,                                                \
+                *pExFrame = ExceptTry(pC, &exFrame, __FILE__, __LINE__);\
+         pExFrame->scope != FINALLY || pExFrame->ready > 0 ||           \
+         ExceptFinally(pC);                                             \
+         pExFrame->scope = FINALLY)                                     \
+        if (pExFrame->scope != FINALLY)                                 \
+            TRY_LOOP
+
+#else   /* EXCEPT_STACK_FRAMES */
+
+#define try                                                             \
+    ExceptTry(pC, NULL, __FILE__, __LINE__);                            \
+    TRY_LOOP
+
+#endif  /* EXCEPT_STACK_FRAMES */
+
 #define catch(class, e)                                                 \
             }                                                           \
             while (0);                                                  \
         }                                                               \
         else if (CHECK(pC, &checked, class, __FILE__, __LINE__) &&      \
-                 pC->pEx->ready && ExceptCatch(pC, class))              \
+                 pC->pEx->scope == INTERNAL && CATCH_MATCH(pC, class))  \
         {                                                               \
-            Except *e = LifoPeek(pC->exStack, 1);                       \
+            Except *e = pC->pEx;                                        \
             pC->pEx->scope = CATCH;                                     \
             do                                                          \
             {
 
+#ifdef  EXCEPT_STACK_FRAMES
+
 #define finally                                                         \
-            }                                                           \
-            while (0);                                                  \
-        }                                                               \
-        if (CHECK_END)                                                  \
-            continue;                                                   \
-        if (!pC->pEx->ready && SETJMP(pC->pEx->finalBuf) == 0)          \
-            pC->pEx->ready = 1;                                         \
+        FINALLY_LOOP_END                                                \
         else                                                            \
-            break;                                                      \
-    }                                                                   \
+            while (pExFrame->ready-- > 0)
+
+#else   /* EXCEPT_STACK_FRAMES */
+
+#define finally                                                         \
+        FINALLY_LOOP_END                                                \
     ExceptGetContext(pC)->pEx->scope = FINALLY;                         \
     while (ExceptGetContext(pC)->pEx->ready > 0 || ExceptFinally(pC))   \
         while (ExceptGetContext(pC)->pEx->ready-- > 0)
 
+#endif  /* EXCEPT_STACK_FRAMES */
+
 #define throw(pExceptOrClass, pData)                                    \
     ExceptThrow(pC, (ClassRef)pExceptOrClass, pData, __FILE__, __LINE__)
 
+#define throw_instance(instance)                                        \
+    ExceptThrowInstance(pC, &(instance))
+
 #define return(x)                                                       \
     {                                                                   \
-        if (ExceptGetScope(pC) != OUTSIDE)                              \
-        {                                                               \
-            void *      pData = malloc(sizeof(JMP_BUF));                \
-            ExceptGetContext(pC)->pEx->pData = pData;                   \
-            if (SETJMP(*(JMP_BUF *)pData) == 0)                         \
-                ExceptReturn(pC);                                       \
-            else                                                        \
-                free(pData);                                            \
-        }                                                               \
+        JMP_BUF *       pReturnBuf = ExceptGetReturnBuf(pC);            \
+                                                                        \
+        if (pReturnBuf != NULL && SETJMP(*pReturnBuf) == 0)             \
+            ExceptReturn(pC);                                           \
         return x;                                                       \
     }
 
+#define ExceptClassOf(e)                ((e)->class)
+#define ExceptDataOf(e)                 ((e)->pData)
+#define ExceptFileOf(e)                 ((e)->file)
+#define ExceptLineOf(e)                 ((e)->line)
+#define ExceptStackOf(e)                ((e)->pStack)
+
 #define pending                                                         \
     (ExceptGetContext(pC)->pEx->state == PENDING)
 
 extern Scope    ExceptGetScope(Context *pC);
 extern Context *ExceptGetContext(Context *pC);
-extern void     ExceptThreadCleanup(int threadId);
-extern void     ExceptTry(Context *pC, char *file, int line);
+extern JMP_BUF *ExceptGetReturnBuf(Context *pC);
+extern void     ExceptThreadCleanup(uintptr_t threadId);
+extern Except * ExceptTry(Context *pC, Except *pFrame, char *file,
+                          int line);
 extern void     ExceptThrow(Context *pC, void * pExceptOrClass,
                             void *pData, char *file, int line);
-extern int      ExceptCatch(Context *pC, ClassRef class);
+extern void     ExceptThrowInstance(Context *pC, ExceptInstance *pInstance);
+extern int      ExceptCatch(Context *pC, ClassRef class,
+                            uintptr_t *pCache);
 extern int      ExceptFinally(Context *pC);
 extern void     ExceptReturn(Context *pC);
-extern int      ExceptCheckBegin(Context *pC, int *pChecked,
+extern char *   ExceptMessageOf(Except *pEx, char *pBuffer, size_t size);
+extern void     ExceptPrintTraceOf(Except *pEx, FILE *pFile);
+extern void     ExceptPrintStackOf(Except *pEx, FILE *pFile);
+extern void     ExceptGetPoolStats(PoolStats *pStats);
+extern void     ExceptGetMutexStats(MutexStats *pStats);
+extern void     ExceptSetInitialDepth(int depth);
+extern int      ExceptGetStats(SiteStats *pStats, int max);
+extern void     ExceptPrintStats(FILE *pFile, int json);
+extern char *   ExceptEventName(TraceEvent event);
+extern int      ExceptGetEvents(TraceRecord *pRecords, int max);
+extern void     ExceptPrintEvents(FILE *pFile);
+extern int      ExceptCheckBegin(Context *pC, CheckTable *pTable,
                                  char *file, int line);
-extern int      ExceptCheck(Context *pC, int *pChecked, ClassRef class,
+extern int      ExceptCheck(Context *pC, CheckTable *pTable, ClassRef class,
                             char *file, int line);
         
 
@@ -3,7 +3,41 @@
  *
  *  DESCRIPTION
  *      This module contains routines for managing hash tables that use
- *      integer numbers as key.
+ *      integer numbers as key.  Keys are full pointer width, so a thread ID
+ *      or an address can be used without truncation.
+ *
+ *      The table uses open addressing with linear probing and Robin Hood
+ *      ordering: an entry that is further from its home slot takes the place
+ *      of one that is closer to its own, so that along a run of occupied
+ *      slots the home slots never decrease.  This keeps probe sequences
+ *      short, lets a lookup stop as soon as it meets an entry that is closer
+ *      to home than the searched key would be, and allows deletion without
+ *      tombstones (the entries that follow are shifted back).  The slot array
+ *      doubles when the load exceeds HASH_MAX_LOAD percent and halves when it
+ *      drops below HASH_MIN_LOAD percent.  The thresholds are a factor eight
+ *      apart, so that after a resize the load is a factor four away from
+ *      either of them; a table does not flip back and forth between two sizes
+ *      when the number of entries goes up and down a little.
+ *
+ *      HashLookup() may run concurrently with one modifying routine (callers
+ *      must serialize HashAdd() and HashRemove() themselves); it never waits.
+ *      Each slot holds a single pointer to a node with the key and the user
+ *      data, so a slot is always read whole.  Insertion and deletion move the
+ *      nodes of a run one slot at a time, in an order that leaves each node
+ *      present in at least one slot; so a lookup that sees the table as it is
+ *      at one moment, even halfway a modification, finds a key that is there.
+ *      The table has a version that is raised after every slot store; a
+ *      lookup that did not find the key and saw the version change during
+ *      its search (it may have seen slots of different moments) is repeated.
+ *      A lookup that finds the key, or during which the table did not change,
+ *      is done.  In particular a lookup is never repeated for a modification
+ *      that it interrupted (from a signal handler in the same thread).
+ *
+ *      Removed nodes and slot arrays replaced by a resize may still be read
+ *      by a lookup, so they are retired instead of freed.  A lookup counts
+ *      itself in one of HASH_READER_SLOTS counters (chosen by key, so that
+ *      threads mostly use different ones), and the modifying routines free
+ *      all retired memory as soon as they find all counters zero.
  *
  *  INCLUDE FILES
  *      Hash.h
@@ -22,17 +56,60 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include "List.h"
+#include <limits.h>
 #include "Hash.h"
 #include "Assert.h"     /* includes "Except.h" which defines return() macro */
 
-#define HASH_SIZE       256     /* hash table size (power of 2 << HASH_SIZE) */
+#define HASH_MIN_BITS   4       /* log2 of initial (and minimum) size */
+#define HASH_MAX_LOAD   75      /* grow when more slots (percent) are used */
+#define HASH_MIN_LOAD   9       /* shrink when less slots (percent) are used */
 
-typedef struct                  /* hash table node */
+#if     HASH_MIN_LOAD * 8 > HASH_MAX_LOAD
+#error  "HASH_MIN_LOAD must be a factor eight below HASH_MAX_LOAD"
+#endif
+#if     HASH_READER_SLOTS & (HASH_READER_SLOTS - 1)
+#error  "HASH_READER_SLOTS must be a power of 2"
+#endif
+
+#define HASH_KEY_BITS   ((int)(sizeof(uintptr_t) * CHAR_BIT))
+
+#if     UINTPTR_MAX > 0xffffffffu
+#define HASH_GOLDEN     ((uintptr_t)0x9e3779b97f4a7c15ull)
+#else
+#define HASH_GOLDEN     ((uintptr_t)0x9e3779b9u)
+#endif
+
+/* Slots, nodes and version are shared with concurrent HashLookup() calls. */
+#define LOAD(field)             __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define STORE(field, value)     __atomic_store_n(&(field), value, __ATOMIC_RELEASE)
+
+
+/******************************************************************************
+ *
+ *      HashTableCreate - create empty slot array
+ *
+ *  DESCRIPTION
+ *      This routine allocates a slot array of 2^<bits> empty slots.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to slot array.
+ */
+
+static HashTable * HashTableCreate(
+    int         bits)           /* log2 of number of slots */
 {
-    void *      pData;          /* pointer to the user data */
-    int         key;            /* key number */
-} HashNode;
+    HashTable * pTable;
+
+    pTable = calloc(1, sizeof(HashTable) + (sizeof(HashNode *) << bits));
+
+    pTable->size  = 1 << bits;
+    pTable->shift = HASH_KEY_BITS - bits;
+
+    return pTable;
+}
 
 
 /******************************************************************************
@@ -52,26 +129,59 @@ typedef struct                  /* hash table node */
 Hash * HashCreate(void)
 {
     Hash *      pHash;
-    int         n;
-
-    pHash = malloc(sizeof(Hash));
 
-    pHash->count = 0;
+    pHash = calloc(1, sizeof(Hash));
 
-    pHash->pNodeLists = malloc(HASH_SIZE * sizeof(List *));
-    for (n = 0; n < HASH_SIZE; n++)
-        pHash->pNodeLists[n] = ListCreate();
+    pHash->pTable = HashTableCreate(HASH_MIN_BITS);
 
     return pHash;
 } 
 
 
+/******************************************************************************
+ *
+ *      HashFreeRetired - free retired nodes and slot arrays
+ *
+ *  DESCRIPTION
+ *      This routine frees the nodes and slot arrays that were retired by
+ *      HashRemove() and HashResize().  The caller makes sure that no lookup
+ *      can still be reading them.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void HashFreeRetired(
+    Hash *      pHash)          /* pointer to hash table */
+{
+    while (pHash->pRetiredTables != NULL)
+    {
+        HashTable *     pTable = pHash->pRetiredTables;
+
+        pHash->pRetiredTables = pTable->pRetired;
+        free(pTable);
+    }
+
+    while (pHash->pRetiredNodes != NULL)
+    {
+        HashNode *      pNode = pHash->pRetiredNodes;
+
+        pHash->pRetiredNodes = pNode->pRetired;
+        free(pNode);
+    }
+}
+
+
 /******************************************************************************
  *
  *      HashDestroy - free hash table
  *
  *  DESCRIPTION
- *      This routine frees the memory that is occupied by the hash table.
+ *      This routine frees the memory that is occupied by the hash table,
+ *      including the retired nodes and slot arrays.
  *
  *  SIDE EFFECTS
  *      None.
@@ -87,10 +197,11 @@ void HashDestroy(
 
     assert(pHash != NULL);
 
-    for (n = 0; n < HASH_SIZE; n++)
-        ListDestroyData(pHash->pNodeLists[n]);
+    for (n = 0; n < pHash->pTable->size; n++)
+        free(pHash->pTable->slots[n]);
+    free(pHash->pTable);
 
-    free(pHash->pNodeLists);
+    HashFreeRetired(pHash);
     free(pHash);
 }
 
@@ -119,23 +230,13 @@ void HashDestroyData(
 
     assert(pHash != NULL);
 
-    for (n = 0; n < HASH_SIZE; n++)
+    for (n = 0; n < pHash->pTable->size; n++)
     {
-        HashNode *      pNode;
-
-        pNode = ListHead(pHash->pNodeLists[n]);
-        while (pNode != NULL)
-        {
-            free(pNode->pData);
-
-            pNode = ListNext(pHash->pNodeLists[n]);
-        }
-
-        ListDestroyData(pHash->pNodeLists[n]);
+        if (pHash->pTable->slots[n] != NULL)
+            free(pHash->pTable->slots[n]->pData);
     }
 
-    free(pHash->pNodeLists);
-    free(pHash);
+    HashDestroy(pHash);
 }
 
 
@@ -145,23 +246,19 @@ void HashDestroyData(
  *
  *  DESCRIPTION
  *      This routine calculates the hash value of integral key <key> for
- *      the specified hash table.
+ *      the specified slot array.  This is the home slot of the key.
  *
  *  INTERNAL
  *      We use the 'multiplication method' as described in "Introduction to
  *      Algorithms" by Thomas H. Cormen, Charles E. Leiserson, and Ronald L.
  *      Rivest, MIT Press - 7th printing 1996, page 228.
  *
- *      To avoid floating point operations and gain speed, the calculations are
- *      done with integers by scaling with a factor 2^16.  For 'A' we used the
- *      golden ration as Knuth suggested.  The modulo operation is implemented 
- *      with bitwise AND, and the division with right shift.
- *
- *      Tests showed that the used constants indeed give a nice even distri-
- *      bution of the hash values (no matter if <key> is incremented with 1, 2,
- *      4, 8 or other values).
- *
- *      The HASH_SIZE must be much lower than the scale factor.
+ *      The key is multiplied by the golden ratio scaled to the full width of
+ *      uintptr_t (as Knuth suggested); the product wraps around, which is the
+ *      modulo operation.  The top bits of the product are taken as index.
+ *      These depend on all bits of the key, so keys that only differ in their
+ *      high bits (like pthread_t values, which are often addresses of page
+ *      aligned thread descriptors) are spread evenly too.
  *
  *  SIDE EFFECTS
  *      None.
@@ -171,30 +268,262 @@ void HashDestroyData(
  */
 
 static int HashValue(
-    Hash *      pHash,          /* pointer to hash table */
-    unsigned    key)            /* key number */
+    HashTable * pTable,         /* pointer to slot array */
+    uintptr_t   key)            /* key number */
 {
     int value;
 
-    assert(pHash != NULL);
-
-    value = (HASH_SIZE * ((key * 40503) & 65535)) >> 16;
-    
-    if (value >= HASH_SIZE || value < 0)
-        fprintf(stderr, "INVALID HashValue: %d\n", value);
+    value = (int)((key * HASH_GOLDEN) >> pTable->shift);
 
     return value;
 }
 
 
+/******************************************************************************
+ *
+ *      HashDistance - get distance of slot from home slot of its key
+ *
+ *  DESCRIPTION
+ *      This routine calculates how many slots node <pNode>, stored in slot
+ *      <index>, is away from its home slot.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Probe distance.
+ */
+
+static int HashDistance(
+    HashTable * pTable,         /* pointer to slot array */
+    int         index,          /* slot index */
+    HashNode *  pNode)          /* node in slot */
+{
+    int         distance;
+
+    distance = (index - HashValue(pTable, pNode->key)) & (pTable->size - 1);
+
+    return distance;
+}
+
+
+/******************************************************************************
+ *
+ *      HashStore - store node in slot
+ *
+ *  DESCRIPTION
+ *      This routine stores <pNode> (or NULL to empty it) in slot <index> and
+ *      then raises the version of the hash table, so that a lookup that may
+ *      have missed its key because of this store is repeated (refer to the
+ *      module description).  <pHash> is NULL for a slot array that is not
+ *      visible to lookups yet.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void HashStore(
+    Hash *      pHash,          /* pointer to hash table or NULL */
+    HashTable * pTable,         /* pointer to slot array */
+    int         index,          /* slot index */
+    HashNode *  pNode)          /* node to store or NULL */
+{
+    STORE(pTable->slots[index], pNode);
+
+    if (pHash != NULL)
+        STORE(pHash->version, pHash->version + 1);
+}
+
+
+/******************************************************************************
+ *
+ *      HashPlace - store node using Robin Hood ordering
+ *
+ *  DESCRIPTION
+ *      This routine stores <pNode> in the slot array.  Walking from the home
+ *      slot, its place is the first slot that is empty or holds a node that
+ *      is closer to its home slot.  The nodes from there up to the next empty
+ *      slot are shifted one slot on, starting with the last one, so that each
+ *      node is in at least one slot all the time.  The key must not be
+ *      present yet, and there must be at least one empty slot.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void HashPlace(
+    Hash *      pHash,          /* pointer to hash table or NULL */
+    HashTable * pTable,         /* pointer to slot array */
+    HashNode *  pNode)          /* node to be stored */
+{
+    HashNode ** pSlots = pTable->slots;
+    int         mask = pTable->size - 1;
+    int         index = HashValue(pTable, pNode->key);
+    int         distance = 0;
+    int         last;
+
+    while (pSlots[index] != NULL &&
+           HashDistance(pTable, index, pSlots[index]) >= distance)
+    {
+        index = (index + 1) & mask;
+        distance++;
+    }
+
+    for (last = index; pSlots[last] != NULL; last = (last + 1) & mask)
+        ;
+    for (; last != index; last = (last - 1) & mask)
+        HashStore(pHash, pTable, last, pSlots[(last - 1) & mask]);
+
+    HashStore(pHash, pTable, index, pNode);
+}
+
+
+/******************************************************************************
+ *
+ *      HashReclaim - free retired memory if no lookup is in progress
+ *
+ *  DESCRIPTION
+ *      This routine frees the retired nodes and slot arrays when all reader
+ *      counters are zero.  A lookup that starts later can only get to the
+ *      current slot array and the nodes in it.  Otherwise they are kept until
+ *      a later modification finds no lookups.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void HashReclaim(
+    Hash *      pHash)          /* pointer to hash table */
+{
+    int         n;
+
+    if (pHash->pRetiredTables == NULL && pHash->pRetiredNodes == NULL)
+        return;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    /* retire before checking */
+    for (n = 0; n < HASH_READER_SLOTS; n++)
+    {
+        if (LOAD(pHash->readers[n].count) != 0)
+            return;
+    }
+
+    HashFreeRetired(pHash);
+}
+
+
+/******************************************************************************
+ *
+ *      HashResize - change number of slots
+ *
+ *  DESCRIPTION
+ *      This routine replaces the slot array by one of 2^<bits> slots, and
+ *      moves all nodes to it.  The old array is retired.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      N/A.
+ */
+
+static void HashResize(
+    Hash *      pHash,          /* pointer to hash table */
+    int         bits)           /* log2 of new number of slots */
+{
+    HashTable * pOldTable = pHash->pTable;
+    HashTable * pTable;
+    int         n;
+
+    pTable = HashTableCreate(bits);
+    for (n = 0; n < pOldTable->size; n++)
+    {
+        if (pOldTable->slots[n] != NULL)
+            HashPlace(NULL, pTable, pOldTable->slots[n]);
+    }
+
+    STORE(pHash->pTable, pTable);
+    STORE(pHash->version, pHash->version + 1);
+
+    pOldTable->pRetired   = pHash->pRetiredTables;
+    pHash->pRetiredTables = pOldTable;
+}
+
+
+/******************************************************************************
+ *
+ *      HashFind - find node of key
+ *
+ *  DESCRIPTION
+ *      This routine probes from the home slot of <key> until the key is found,
+ *      an empty slot is met, or a node is met that is closer to its home slot
+ *      than <key> would be at this point; with Robin Hood ordering the key
+ *      can't be stored beyond such a node.  Each slot is read once.
+ *
+ *      The probe is also ended after visiting all slots; this can only happen
+ *      to a lookup that combines slots seen at different moments, whose
+ *      result is checked anyway.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Node found (its slot index in <pIndex> if not NULL), or NULL.
+ */
+
+static HashNode * HashFind(
+    HashTable * pTable,         /* pointer to slot array */
+    uintptr_t   key,            /* key number */
+    int *       pIndex)         /* receives slot index or NULL */
+{
+    int         mask = pTable->size - 1;
+    int         index = HashValue(pTable, key);
+    int         distance = 0;
+    HashNode *  pNode;
+
+    while ((pNode = LOAD(pTable->slots[index])) != NULL && distance <= mask)
+    {
+        if (pNode->key == key)
+        {
+            if (pIndex != NULL)
+                *pIndex = index;
+
+            return pNode;
+        }
+
+        if (HashDistance(pTable, index, pNode) < distance)
+            break;
+
+        index = (index + 1) & mask;
+        distance++;
+    }
+
+    return NULL;
+}
+
+
 /******************************************************************************
  *
  *      HashLookup - find hash node of key
  *
  *  DESCRIPTION
- *      This routine looks up the hash node value belonging to <pKey> in the
- *      specified hash table.  If two or more nodes with the same key exist,
- *      the most recent added to the hash table is returned.
+ *      This routine looks up the hash node value belonging to <key> in the
+ *      specified hash table.
+ *
+ *      It may be called while another thread modifies the table, or from a
+ *      signal handler that interrupted a modification.  While the lookup
+ *      runs, it is counted in the reader counter of its key.  When the key
+ *      is not found and the table version changed meanwhile, the search is
+ *      repeated; this only happens when a modification made progress, so
+ *      the lookup never waits for one.
  *
  *  SIDE EFFECTS
  *      None.
@@ -205,27 +534,34 @@ static int HashValue(
 
 void * HashLookup(
     Hash *      pHash,          /* pointer to hash table */
-    int         key)            /* key number */
+    uintptr_t   key)            /* key number */
 {
-    List *      nodeList;
+    HashReaders *pReaders;
     HashNode *  pNode;
+    unsigned long version;
+    void *      pData;
 
     assert(pHash != NULL);
 
-    nodeList = pHash->pNodeLists[HashValue(pHash, key)];
+    pReaders = &pHash->readers[((key * HASH_GOLDEN) >> (HASH_KEY_BITS - 8)) &
+                               (HASH_READER_SLOTS - 1)];
+    __atomic_fetch_add(&pReaders->count, 1, __ATOMIC_SEQ_CST);
 
-    pNode = ListHead(nodeList);
-    while (pNode != NULL)
+    do
     {
-        if (pNode->key == key)
-        {
-            return pNode->pData;
-        }
+        version = LOAD(pHash->version);
+        pNode   = HashFind(LOAD(pHash->pTable), key, NULL);
 
-        pNode = ListNext(nodeList);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
     }
+    while (pNode == NULL &&
+           __atomic_load_n(&pHash->version, __ATOMIC_RELAXED) != version);
 
-    return NULL;
+    pData = pNode == NULL ? NULL : LOAD(pNode->pData);
+
+    __atomic_fetch_sub(&pReaders->count, 1, __ATOMIC_RELEASE);
+
+    return pData;
 }
 
 
@@ -235,13 +571,14 @@ void * HashLookup(
  *
  *  DESCRIPTION
  *      This routine adds a node to the specified hash table.  The node has
- *      key <key> and will store <pData>.
+ *      key <key> and will store <pData>.  When a node with this key is already
+ *      present, its value is replaced by <pData>.
  *
  *      The <pData> value may not be zero (because HashLookup() uses it as
  *      'not found' return value).
  *
  *  SIDE EFFECTS
- *      None.
+ *      May grow the slot array; may free retired memory.
  *
  *  RETURNS
  *      N/A.
@@ -249,7 +586,7 @@ void * HashLookup(
 
 void HashAdd(
     Hash *      pHash,          /* pointer to hash table */
-    int         key,            /* key number */
+    uintptr_t   key,            /* key number */
     void *      pData)          /* user data to be stored */
 {
     HashNode *  pNode;
@@ -257,12 +594,26 @@ void HashAdd(
     assert(pHash != NULL);
     validate(pData != 0, NOTHING);
 
-    pNode = malloc(sizeof(HashNode));
-    pNode->key   = key;
-    pNode->pData = pData;
+    pNode = HashFind(pHash->pTable, key, NULL);
+    if (pNode != NULL)
+    {
+        STORE(pNode->pData, pData);
+    }
+    else
+    {
+        if ((pHash->count + 1) * 100 > pHash->pTable->size * HASH_MAX_LOAD)
+            HashResize(pHash, HASH_KEY_BITS - pHash->pTable->shift + 1);
+
+        pNode = malloc(sizeof(HashNode));
+        pNode->key      = key;
+        pNode->pData    = pData;
+        pNode->pRetired = NULL;
 
-    ListAddHead(pHash->pNodeLists[HashValue(pHash, key)], pNode);
-    pHash->count++;
+        HashPlace(pHash, pHash->pTable, pNode);
+        pHash->count++;
+    }
+
+    HashReclaim(pHash);
 }
 
 
@@ -271,14 +622,15 @@ void HashAdd(
  *      HashRemove - remove node from hash table
  *
  *  DESCRIPTION
- *      This routine removes the node defined by <pKey> from the specified
+ *      This routine removes the node defined by <key> from the specified
  *      hash table.
  *
- *      Identical keys stored in the hash table are removed in FIFO order; this
- *      means that the most recent added one is removed.
+ *      Instead of leaving a tombstone, the nodes following the removed one
+ *      are shifted back one slot, until an empty slot or a node in its home
+ *      slot is met.  The removed node is retired.
  *
  *  SIDE EFFECTS
- *      None.
+ *      May shrink the slot array; may free retired memory.
  *
  *  RETURNS
  *      Removed node value, or NULL if not found.
@@ -286,33 +638,48 @@ void HashAdd(
 
 void * HashRemove(
     Hash *      pHash,          /* pointer to hash table */
-    int         key)            /* key number */
+    uintptr_t   key)            /* key number */
 {
-    List *      nodeList;
+    HashTable * pTable;
+    HashNode ** pSlots;
     HashNode *  pNode;
+    int         mask;
+    int         index;
+    int         next;
     void *      pData;
 
     assert(pHash != NULL);
 
-    nodeList = pHash->pNodeLists[HashValue(pHash, key)];
+    pTable = pHash->pTable;
+    pNode  = HashFind(pTable, key, &index);
+    if (pNode == NULL)
+        return NULL;
 
-    pNode = ListHead(nodeList);
-    while (pNode != NULL)
+    pSlots = pTable->slots;
+    mask   = pTable->size - 1;
+    next   = (index + 1) & mask;
+    while (pSlots[next] != NULL && HashDistance(pTable, next, pSlots[next]) > 0)
     {
-        if (pNode->key == key)
-        {
-            ListRemoveLast(nodeList);
-            pData = pNode->pData;
-            free(pNode);
-            pHash->count--;
+        HashStore(pHash, pTable, index, pSlots[next]);
+        index = next;
+        next  = (next + 1) & mask;
+    }
+    HashStore(pHash, pTable, index, NULL);
 
-            return pData;
-        }
+    pData = pNode->pData;
+    pNode->pRetired      = pHash->pRetiredNodes;
+    pHash->pRetiredNodes = pNode;
 
-        pNode = ListNext(nodeList);
+    pHash->count--;
+    if (pTable->shift < HASH_KEY_BITS - HASH_MIN_BITS &&
+        pHash->count * 100 < pTable->size * HASH_MIN_LOAD)
+    {
+        HashResize(pHash, HASH_KEY_BITS - pTable->shift - 1);
     }
 
-    return NULL;
+    HashReclaim(pHash);
+
+    return pData;
 }
 
 
@@ -20,13 +20,43 @@
 #ifndef _HASH_H
 #define _HASH_H
 
-#include "List.h"
+#include <stdint.h>
+
+#define HASH_READER_SLOTS       16      /* reader counters (2^n) */
+
+typedef struct _HashNode        HashNode;       /* stored entry */
+struct _HashNode
+{
+    uintptr_t   key;            /* key number (never changes) */
+    void *      pData;          /* user data */
+    HashNode *  pRetired;       /* next removed node waiting to be freed */
+};
+
+typedef struct _HashTable       HashTable;      /* slot array */
+struct _HashTable
+{
+    HashTable * pRetired;       /* next replaced array waiting to be freed */
+    int         size;           /* number of slots (power of 2) */
+    int         shift;          /* right shift yielding index from product */
+    HashNode *  slots[];        /* open-addressing slots, NULL when empty */
+};
+
+typedef struct _HashReaders     HashReaders;    /* lookups in progress */
+struct _HashReaders
+{
+    unsigned long       count;  /* number of lookups using this counter */
+    char        pad[64 - sizeof(unsigned long)];    /* own cache line */
+};
 
 typedef struct _Hash    Hash;   /* hash table */
 struct _Hash            
 {
-    List **     pNodeLists;     /* node lists */
+    HashTable * pTable;         /* current slot array */
+    unsigned long       version;        /* number of slot stores so far */
     int         count;          /* number of stored nodes */
+    HashTable * pRetiredTables; /* replaced arrays not freed yet */
+    HashNode *  pRetiredNodes;  /* removed nodes not freed yet */
+    HashReaders readers[HASH_READER_SLOTS];     /* hashed by key */
 };
 
 
@@ -44,18 +74,18 @@ void HashDestroyData(
 extern
 void * HashLookup(
     Hash *      pHash,          /* pointer to hash table */
-    int         key);           /* key number */
+    uintptr_t   key);           /* key number */
 
 extern
 void HashAdd(
     Hash *      pHash,          /* pointer to hash table */
-    int         key,            /* key number */
+    uintptr_t   key,            /* key number */
     void *      pData);         /* user data to be stored */
 
 extern
 void * HashRemove(
     Hash *      pHash,          /* pointer to hash table */
-    int         key);           /* key number */
+    uintptr_t   key);           /* key number */
 
 extern
 int HashCount(
@@ -4,7 +4,15 @@
  *  DESCRIPTION
  *      This module contains routines for managing LIFO buffers (i.e., stacks).
  *      The size of a LIFO buffer is increased automatically when needed, so
- *      it never becomes full.  The size is however never decreased.
+ *      it never becomes full.
+ *
+ *      The objects are kept in a chain of segments.  When the top segment is
+ *      full a new one, twice as large, is put on top of it; existing objects
+ *      are never copied or moved.  So pushing costs constant time even when
+ *      the buffer grows to a large size, and pointers to object slots stay
+ *      valid.  When popping empties the top segment, it is kept as spare so
+ *      that pushing and popping around a segment boundary does not allocate;
+ *      a larger spare is freed at that point.
  *
  *  INCLUDE FILES
  *      Lifo.h
@@ -25,17 +33,43 @@
 #include "Lifo.h"
 #include "Assert.h"     /* includes "Except.h" which defines return() macro */
 
-#define INIT_SIZE       32      /* initial size */
-#define INCR_SIZE       32      /* size increment when not enough space */
+#define INIT_SIZE       32      /* default initial size */
 
 
 /******************************************************************************
  *
- *      LifoCreate - create LIFO buffer of unlimited size
+ *      LifoNewSegment - allocate LIFO buffer segment
  *
  *  DESCRIPTION
- *      This routine creates an empty LIFO buffer.  The size is increased when
- *      needed.
+ *      This routine allocates a segment for <size> objects.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to segment.
+ */
+
+static LifoSegment * LifoNewSegment(
+    int         size)           /* number of objects */
+{
+    LifoSegment *pSegment;
+
+    pSegment = malloc(sizeof(LifoSegment) + size * sizeof(void *));
+    pSegment->pPrevious = NULL;
+    pSegment->size = size;
+
+    return pSegment;
+}
+
+
+/******************************************************************************
+ *
+ *      LifoCreateSized - create LIFO buffer with initial size
+ *
+ *  DESCRIPTION
+ *      This routine creates an empty LIFO buffer that can hold <size> objects
+ *      before it needs to grow.  The size is increased when needed.
  *
  *  SIDE EFFECTS
  *      None.
@@ -44,18 +78,44 @@
  *      Pointer to LIFO buffer.
  */
 
-Lifo * LifoCreate(void)
+Lifo * LifoCreateSized(
+    int         size)           /* initial size */
 {
     Lifo *      pLifo;
 
+    if (size < 1)
+        size = 1;
+
     pLifo = malloc(sizeof(Lifo));
-    pLifo->pObjects = malloc(INIT_SIZE * sizeof(void *));
-    pLifo->size = INIT_SIZE;
+    pLifo->pSegment = LifoNewSegment(size);
+    pLifo->pSpare = NULL;
     pLifo->pointer = 0;
+    pLifo->count = 0;
     return pLifo;
 }
 
 
+/******************************************************************************
+ *
+ *      LifoCreate - create LIFO buffer of unlimited size
+ *
+ *  DESCRIPTION
+ *      This routine creates an empty LIFO buffer.  The size is increased when
+ *      needed.
+ *
+ *  SIDE EFFECTS
+ *      None.
+ *
+ *  RETURNS
+ *      Pointer to LIFO buffer.
+ */
+
+Lifo * LifoCreate(void)
+{
+    return LifoCreateSized(INIT_SIZE);
+}
+
+
 /******************************************************************************
  *
  *      LifoDestroy - free LIFO buffer
@@ -73,9 +133,17 @@ Lifo * LifoCreate(void)
 void LifoDestroy(
     Lifo *      pLifo)          /* pointer to LIFO buffer */
 {
+    LifoSegment *pSegment;
+
     assert(pLifo != NULL);
 
-    free(pLifo->pObjects);
+    while ((pSegment = pLifo->pSegment) != NULL)
+    {
+        pLifo->pSegment = pSegment->pPrevious;
+        free(pSegment);
+    }
+
+    free(pLifo->pSpare);
     free(pLifo);
 }
 
@@ -102,11 +170,10 @@ void LifoDestroyData(
 {
     assert(pLifo != NULL);
 
-    while(pLifo->pointer > 0)
-        free(pLifo->pObjects[pLifo->pointer--]);
+    while (pLifo->count > 0)
+        free(LifoPop(pLifo));
 
-    free(pLifo->pObjects);
-    free(pLifo);
+    LifoDestroy(pLifo);
 }
 
 
@@ -115,7 +182,9 @@ void LifoDestroyData(
  *      LifoPush - push object to LIFO buffer
  *
  *  DESCRIPTION
- *      This routine adds an object to the top of specified LIFO buffer.
+ *      This routine adds an object to the top of specified LIFO buffer.  When
+ *      the top segment is full, the spare segment or a new one of twice the
+ *      size is put on top.
  *
  *  SIDE EFFECTS
  *      None.
@@ -130,12 +199,21 @@ void LifoPush(
 {
     assert(pLifo != NULL && pObject != NULL);
 
-    if (pLifo->pointer == pLifo->size) {
-        pLifo->size += INCR_SIZE;
-        pLifo->pObjects = realloc(pLifo->pObjects,
-                                  pLifo->size * sizeof(void *));
+    if (pLifo->pointer == pLifo->pSegment->size)
+    {
+        LifoSegment *pSegment = pLifo->pSpare;
+
+        if (pSegment != NULL)
+            pLifo->pSpare = NULL;
+        else
+            pSegment = LifoNewSegment(2 * pLifo->pSegment->size);
+
+        pSegment->pPrevious = pLifo->pSegment;
+        pLifo->pSegment = pSegment;
+        pLifo->pointer = 0;
     }
-    pLifo->pObjects[pLifo->pointer++] = pObject;
+    pLifo->pSegment->pObjects[pLifo->pointer++] = pObject;
+    pLifo->count++;
 }
 
 
@@ -145,7 +223,8 @@ void LifoPush(
  *
  *  DESCRIPTION
  *      This routine removes an object from the top of the specified LIFO
- *      buffer.
+ *      buffer.  When this empties the top segment (and it's not the bottom
+ *      one), the segment becomes the spare.
  *
  *      It is illegal to perform this operation on an empty LIFO buffer (will
  *      result in failed assertion when DEBUG defined, otherwise returns NULL).
@@ -160,10 +239,25 @@ void LifoPush(
 void * LifoPop(
     Lifo *      pLifo)          /* pointer to LIFO buffer */
 {
+    LifoSegment *pSegment;
+    void *      pObject;
+
     assert(pLifo != NULL);
-    validate(pLifo->pointer > 0, NULL);
+    validate(pLifo->count > 0, NULL);
+
+    pSegment = pLifo->pSegment;
+    pObject = pSegment->pObjects[--pLifo->pointer];
+    pLifo->count--;
+
+    if (pLifo->pointer == 0 && pSegment->pPrevious != NULL)
+    {
+        free(pLifo->pSpare);
+        pLifo->pSpare = pSegment;
+        pLifo->pSegment = pSegment->pPrevious;
+        pLifo->pointer = pLifo->pSegment->size;
+    }
 
-    return pLifo->pObjects[--pLifo->pointer];
+    return pObject;
 }
 
 
@@ -190,11 +284,22 @@ void * LifoPeek(
     Lifo *      pLifo,          /* pointer to LIFO buffer */
     int         number)         /* object number to get (1: top) */
 {
+    LifoSegment *pSegment;
+    int         index;
+
     assert(pLifo != NULL);
-    validate(pLifo->pointer > 0, NULL);
-    validate(number > 0 && number <= pLifo->pointer, NULL);
+    validate(pLifo->count > 0, NULL);
+    validate(number > 0 && number <= pLifo->count, NULL);
+
+    pSegment = pLifo->pSegment;
+    index = pLifo->pointer - number;
+    while (index < 0)
+    {
+        pSegment = pSegment->pPrevious;
+        index += pSegment->size;
+    }
 
-    return pLifo->pObjects[pLifo->pointer - number];
+    return pSegment->pObjects[index];
 }
 
 
@@ -218,7 +323,7 @@ int LifoCount(
 {
     assert(pLifo != NULL);
 
-    return pLifo->pointer;
+    return pLifo->count;
 }
 
 
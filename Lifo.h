@@ -20,17 +20,30 @@
 #ifndef _LIFO_H
 #define _LIFO_H
 
-typedef struct                  /* LIFO buffer */
+typedef struct _LifoSegment     LifoSegment;    /* LIFO buffer segment */
+struct _LifoSegment
 {
-    void **     pObjects;       /* user object 'array' */
+    LifoSegment *pPrevious;     /* segment below this one */
     int         size;           /* size of object 'array' */
+    void *      pObjects[];     /* user object 'array' */
+};
+
+typedef struct                  /* LIFO buffer */
+{
+    LifoSegment *pSegment;      /* top segment */
+    LifoSegment *pSpare;        /* emptied segment kept for reuse */
     int         pointer;        /* stack pointer points to free 'array' item */
+    int         count;          /* total number of objects */
 } Lifo;
 
 
 extern
 Lifo * LifoCreate(void);
 
+extern
+Lifo * LifoCreateSized(
+    int         size);          /* initial size */
+
 extern
 void LifoDestroy(
     Lifo *      pLifo);         /* pointer to LIFO buffer */
@@ -310,6 +310,17 @@ static int t8(void)
     }
 }
 
+#ifdef  EXCEPT_ALT_STACK
+static int overflow(int n)
+{
+    volatile char       frame[1024];    /* fills the stack faster */
+
+    frame[0] = n;
+
+    return overflow(n + 1) + frame[0];
+}
+#endif
+
 static void TestSignal(void)
 {
     printf("\nSIGNAL TESTS ------------------------------------------\n\n");
@@ -383,6 +394,22 @@ static void TestSignal(void)
         printf("%s\n", e->getMessage());
     }
     finally;
+    printf("\n");
+
+    printf("-->%2d: Stack overflow caught as SegmentationFault?\n", testNum++);
+#ifdef  EXCEPT_ALT_STACK
+    try
+    {
+        overflow(0);
+    }
+    catch (SegmentationFault, e)
+    {
+        printf("%s\n", e->getMessage());
+    }
+    finally;
+#else
+    printf("Not tested: needs EXCEPT_ALT_STACK.\n");
+#endif
 }
 
 static void TestMemory(void)
@@ -738,13 +765,286 @@ static void TestRecursion(void)
 }
 
 
+static int endOfInputLine = __LINE__ + 1;       /* of definition below */
+static except_instance_define(EndOfInput, Level1Exception, "end of input");
+
+static void TestHandles(void)
+{
+    int i;
+
+    printf("\nHANDLE TESTS ------------------------------------------\n\n");
+
+    /* see if pool kept the handles of the 12 levels of the recursion tests */
+    printf("-->%2d: Handle pool reached 12 levels and has 1 in use?\n",
+           testNum++);
+    try
+    {
+        PoolStats       stats;
+
+        ExceptGetPoolStats(&stats);
+        printf("in use %d, allocated %d, high-water %d\n", stats.inUse,
+               stats.allocated, stats.highWater);
+    }
+    catch (Throwable, e);
+    finally;
+    printf("\n");
+
+    /* see if a copy of a caught exception can still be rethrown */
+    {
+        Except  saved;
+
+        try
+        {
+            printf("-->%2d: Rethrow saved copy: prints \"Saved\"?\n", testNum++);
+            throw (Exception, "Saved");
+        }
+        catch (Exception, e)
+            saved = *e;
+        finally;
+
+        try
+            throw (&saved, NULL);
+        catch (Exception, e)
+            printf("%s\n", e->getData());
+        finally;
+    }
+    printf("\n");
+
+    /* see if 'catch' results cached for one class are not used for another */
+    printf("-->%2d: Caught Level2Exception, Exception, Level2Exception by "
+           "Level1Exception, Exception, Level1Exception?\n", testNum++);
+    for (i = 0; i < 3; i++)
+    {
+        try
+        {
+            if (i == 1)
+                throw (Exception, NULL);
+            else
+                throw (Level2Exception, NULL);
+        }
+        catch (Level1Exception, e)
+        {
+            printf("%s by Level1Exception\n", e->class->name);
+        }
+        catch (Exception, e)
+        {
+            printf("%s by Exception\n", e->class->name);
+        }
+        finally;
+    }
+    printf("\n");
+
+    /* see if message is formatted into caller's buffer, and truncated */
+    try
+    {
+        printf("-->%2d: Prints message twice, and truncated to "
+               "\"Level1Exception\"?\n", testNum++);
+        throw (Level1Exception, NULL);
+    }
+    catch (Level1Exception, e)
+    {
+        char    message[80];
+        char    truncated[16];
+
+        printf("%s\n", e->getMessage());
+        printf("%s\n", e->formatMessage(message, sizeof(message)));
+        printf("%s\n", e->formatMessage(truncated, sizeof(truncated)));
+    }
+    finally;
+    printf("\n");
+
+    /* see if accessors give what was thrown, and the same as the members */
+    printf("-->%2d: Accessors match class, data, file, line, message and "
+           "trace?\n", testNum++);
+    {
+        static char     data[] = "Accessed";
+        volatile int    line = 0;
+
+        try
+        {
+            line = __LINE__ + 1;
+            throw (Level1Exception, data);
+        }
+        catch (Level1Exception, e)
+        {
+            char    message[80];
+            char    trace[1024];
+            FILE *  pFile = tmpfile();
+            long    length;
+            size_t  size;
+
+            ExceptPrintTraceOf(e, pFile);
+            length = ftell(pFile);
+            e->printTryTrace(pFile);
+            rewind(pFile);
+            size = fread(trace, 1, sizeof(trace), pFile);
+            fclose(pFile);
+
+            printf("class %s, data %s, file %s, line %s, message %s, "
+                   "trace %s\n",
+                   ExceptClassOf(e) == (ClassRef)Level1Exception ?
+                   "yes" : "no",
+                   ExceptDataOf(e) == data ? "yes" : "no",
+                   strcmp(ExceptFileOf(e), __FILE__) == 0 ? "yes" : "no",
+                   ExceptLineOf(e) == line ? "yes" : "no",
+                   strcmp(ExceptMessageOf(e, message, sizeof(message)),
+                          e->getMessage()) == 0 ? "yes" : "no",
+                   length > 0 && size == 2 * length &&
+                   memcmp(trace, trace + length, length) == 0 ? "yes" : "no");
+        }
+        finally;
+    }
+    printf("\n");
+
+    /* see if prebuilt exception is thrown, with file and line of definition */
+    printf("-->%2d: Caught Level1Exception of line %d twice, with data?\n",
+           testNum++, endOfInputLine);
+    for (i = 0; i < 2; i++)
+    {
+        try
+        {
+            throw_instance(EndOfInput);
+        }
+        catch (Level1Exception, e)
+        {
+            printf("line %d: %s -- %s\n", ExceptLineOf(e), e->getMessage(),
+                   (char *)ExceptDataOf(e));
+        }
+        finally;
+    }
+    printf("\n");
+}
+
+
+static void TestStats(void)
+{
+    printf("\nSTATISTICS TESTS --------------------------------------\n\n");
+
+    printf("-->%2d: Site thrown 3, caught 4, lost 0, rethrown 1?\n",
+           testNum++);
+#ifdef  EXCEPT_STATS
+    {
+        SiteStats       stats[EXCEPT_STATS_SLOTS];
+        int             line = 0;
+        int             count;
+        int             i;
+
+        for (i = 0; i < 3; i++)
+        {
+            try
+            {
+                try
+                {
+                    line = __LINE__ + 1;
+                    throw (Level2Exception, NULL);
+                }
+                catch (Level2Exception, e)
+                {
+                    if (i == 0)
+                        throw (e, NULL);
+                }
+                finally;
+            }
+            catch (Level1Exception, e);
+            finally;
+        }
+
+        count = ExceptGetStats(stats, EXCEPT_STATS_SLOTS);
+        for (i = 0; i < count; i++)
+        {
+            if (strcmp(stats[i].file, __FILE__) == 0 &&
+                stats[i].line == line)
+                printf("%s thrown %lu, caught %lu, lost %lu, rethrown %lu\n",
+                       stats[i].class->name, stats[i].thrown, stats[i].caught,
+                       stats[i].lost, stats[i].rethrown);
+        }
+    }
+#else
+    printf("Not tested: needs EXCEPT_STATS.\n");
+#endif
+    printf("\n");
+}
+
+
+static void TestTrace(void)
+{
+    printf("\nTRACE TESTS -------------------------------------------\n\n");
+
+    printf("-->%2d: Events try, throw, catch, finally at depth 2?\n",
+           testNum++);
+#ifdef  EXCEPT_TRACE
+    try
+    {
+        TraceRecord     records[4];
+        int             count;
+        int             i;
+
+        try
+            throw (Level1Exception, NULL);
+        catch (Level1Exception, e);
+        finally;
+
+        count = ExceptGetEvents(records, 4);
+        for (i = 0; i < count; i++)
+            printf("%s %s depth %d\n", ExceptEventName(records[i].event),
+                   records[i].class != NULL ? records[i].class->name : "-",
+                   records[i].depth);
+    }
+    catch (Throwable, e);
+    finally;
+#else
+    printf("Not tested: needs EXCEPT_TRACE.\n");
+#endif
+    printf("\n");
+}
+
+
+static void ThrowFromDepth(int depth)
+{
+    if (depth == 0)
+        throw (Level1Exception, NULL);
+
+    ThrowFromDepth(depth - 1);
+}
+
+
+static void TestBacktrace(void)
+{
+    printf("\nBACKTRACE TESTS ---------------------------------------\n\n");
+
+    printf("-->%2d: Same stack for same throw, of at least 4 calls?\n",
+           testNum++);
+#ifdef  EXCEPT_BACKTRACE
+    {
+        StackTrace *    stacks[2];
+        int             i;
+
+        for (i = 0; i < 2; i++)
+        {
+            try
+                ThrowFromDepth(3);
+            catch (Level1Exception, e)
+                stacks[i] = ExceptStackOf(e);
+            finally;
+        }
+        printf("same %s, at least 4 calls %s\n",
+               stacks[0] == stacks[1] ? "yes" : "no",
+               stacks[0] != NULL && stacks[0]->depth >= 4 ? "yes" : "no");
+    }
+#else
+    printf("Not tested: needs EXCEPT_BACKTRACE.\n");
+#endif
+    printf("\n");
+}
+
+
 void CheckStack(void)
 {
     Context *pC = ExceptGetContext(NULL);
 
-    if (pC != NULL && pC->exStack != NULL)
+    if (pC != NULL && pC->pEx != NULL)
     {
-        printf("LifoCount == %d != 0\n", LifoCount(pC->exStack));
+        printf("pEx == %p != NULL\n", (void *)pC->pEx);
     }
 }
 
@@ -778,5 +1078,17 @@ int main(void)
     TestSignal();
     CheckStack();
 
+    TestHandles();
+    CheckStack();
+
+    TestStats();
+    CheckStack();
+
+    TestTrace();
+    CheckStack();
+
+    TestBacktrace();
+    CheckStack();
+
     printf("\nREADY\n\n");
 }
@@ -1,22 +1,101 @@
 /*
  * cc thread.c -lpthread Except.o Assert.o Lifo.o Hash.o List.o
+ *
+ * Without arguments 10 launcher threads each start 10 threads that cause a
+ * segmentation fault inside a 'try' statement.
+ *
+ * With "bench" as argument a scaling benchmark is run instead: for 1, 2, 4,
+ * ... up to 64 threads, each thread repeatedly calls a routine containing a
+ * 'try' statement for a fixed duration.  Because these 'try' statements are
+ * not nested inside a 'try' of the same routine, all of their 'finally',
+ * 'throw' and ExceptTry() invocations have to look up the thread's context.
+ * The throughput shows how well this lookup scales with the number of threads
+ * (compare a build with and without EXCEPT_THREAD_LOCAL, or th and th_private
+ * for EXCEPT_MT_SHARED and EXCEPT_MT_PRIVATE).  The duration of each call is
+ * measured too; the 50th, 99th and 99.9th percentiles of all calls are shown.
+ * When built with EXCEPT_MUTEX_STATS, the contended mutex acquisitions and the
+ * time spent waiting for the mutex are shown too.  Options (after "bench"):
+ *
+ *      -t <n>  maximum number of threads (64)
+ *      -r <n>  throw in 1 out of <n> calls, 0 for never (16)
+ *      -d <n>  'try' nesting depth that is thrown through (1)
+ *      -s      throw by causing SIGSEGV instead of by throw()
+ *      -p      pin thread i to CPU i (modulo number of CPUs; Linux only)
+ *      -T <n>  duration per number of threads in milliseconds (1000)
  */
 
+#ifdef  __linux__
+#define _GNU_SOURCE             /* pthread_setaffinity_np() */
+#endif
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "Except.h"
 
 #define NUM_THREADS     10
 #define NUM_LAUNCHERS   10
 
+#define BENCH_THREADS   64      /* default maximum number of threads */
+#define BENCH_RATIO     16      /* default 1 out of this many calls throws */
+#define BENCH_MS        1000    /* default duration per number of threads */
+#define LATENCY_SUB     8       /* latency buckets per power of 2 */
+#define LATENCY_BUCKETS (64 * LATENCY_SUB)
+
+typedef struct _Worker          /* benchmark thread */
+{
+    pthread_t           thread;
+    int                 index;  /* used for CPU pinning */
+    unsigned long       calls;  /* number of calls done */
+    unsigned long       latency[LATENCY_BUCKETS];  /* histogram of calls */
+} Worker;
+
 void *launch(void *);
 void *thread(void *);
+void *bench(void *);
 
-int main(void)
+static int              benchRatio  = BENCH_RATIO;
+static int              benchDepth  = 1;
+static int              benchSignal = 0;
+static int              benchPin    = 0;
+static int              benchMs     = BENCH_MS;
+static volatile int     benchStop;
+
+static int benchmark(int maxThreads);
+
+int main(int argc, char **argv)
 {
     pthread_t   launchers[NUM_LAUNCHERS];
 
     int i;
 
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        int     maxThreads = BENCH_THREADS;
+        int     option;
+
+        optind = 2;
+        while ((option = getopt(argc, argv, "t:r:d:spT:")) != -1)
+        {
+            switch (option)
+            {
+            case 't': maxThreads  = atoi(optarg); break;
+            case 'r': benchRatio  = atoi(optarg); break;
+            case 'd': benchDepth  = atoi(optarg); break;
+            case 's': benchSignal = 1;            break;
+            case 'p': benchPin    = 1;            break;
+            case 'T': benchMs     = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s bench [-t threads] [-r ratio] "
+                        "[-d depth] [-s] [-p] [-T ms]\n", argv[0]);
+                return 1;
+            }
+        }
+
+        return benchmark(maxThreads);
+    }
+
     try
     {
         for (i = 0; i < NUM_LAUNCHERS; i++)
@@ -34,6 +113,10 @@ int main(void)
         e->printTryTrace(0);
     }
     finally;
+
+#ifdef  EXCEPT_STATS
+    ExceptPrintStats(stdout, 0);
+#endif
 }
 
 
@@ -68,3 +151,215 @@ void *thread(void *arg)
     }
     finally;
 }
+
+
+static void level(int depth, int fail)
+{
+    if (depth > 1)
+    {
+        try
+            level(depth - 1, fail);
+        catch (OutOfMemoryError, e);
+        finally;
+    }
+    else if (fail && benchSignal)
+        *((volatile int *)0) = 0;
+    else if (fail)
+        throw (Exception, NULL);
+}
+
+static void step(long n)
+{
+    try
+    {
+        level(benchDepth, benchRatio > 0 && n % benchRatio == 0);
+    }
+    catch (Exception, e);
+    finally;
+}
+
+static double now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Log-linear histogram: LATENCY_SUB buckets for each power of 2 nanoseconds.
+ */
+static int bucket(unsigned long ns)
+{
+    int         power = 0;
+    int         index;
+
+    if (ns < LATENCY_SUB)
+        return ns;
+
+    while ((ns >> power) >= 2 * LATENCY_SUB)
+        power++;
+
+    index = (power + 1) * LATENCY_SUB + (ns >> power) - LATENCY_SUB;
+
+    return index;
+}
+
+static unsigned long bucketLimit(int index)
+{
+    int                 power = index / LATENCY_SUB - 1;
+    unsigned long       limit;
+
+    if (power < 0)
+        limit = index + 1;
+    else
+        limit = (unsigned long)(index % LATENCY_SUB + LATENCY_SUB + 1) << power;
+
+    return limit;
+}
+
+static unsigned long percentile(unsigned long *latency, unsigned long total,
+                                double fraction)
+{
+    unsigned long       count = 0;
+    int                 i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        count += latency[i];
+        if (count >= total * fraction)
+            break;
+    }
+
+    return bucketLimit(i);
+}
+
+void *bench(void *arg)
+{
+    Worker *    pWorker = arg;
+    long        n;
+
+#ifdef  __linux__
+    if (benchPin)
+    {
+        cpu_set_t       cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(pWorker->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    try                         /* keeps context alive in every build */
+    {
+        for (n = 0; !benchStop; n++)
+        {
+            double      start = now();
+
+            step(n);
+            pWorker->latency[bucket((now() - start) * 1e9)]++;
+        }
+        pWorker->calls = n;
+    }
+    catch (Throwable, e)
+    {
+        e->printTryTrace(0);
+    }
+    finally;
+
+    return 0;
+}
+
+static int benchmark(int maxThreads)
+{
+    Worker *            workers;
+    unsigned long *     latency;
+    int                 numThreads;
+    int                 i;
+    int                 j;
+
+    workers = calloc(maxThreads, sizeof(Worker));
+    latency = calloc(LATENCY_BUCKETS, sizeof(unsigned long));
+
+#if     defined(EXCEPT_MT_PRIVATE)
+    printf("# EXCEPT_MT_PRIVATE, ");
+#else
+    printf("# EXCEPT_MT_SHARED, ");
+#endif
+#ifdef  EXCEPT_THREAD_LOCAL
+    printf("context lookup: thread-local\n");
+#else
+    printf("context lookup: hash table\n");
+#endif
+    printf("# %d ms per run, ", benchMs);
+    if (benchRatio > 0)
+        printf("throw 1 in %d calls by %s", benchRatio,
+               benchSignal ? "SIGSEGV" : "throw()");
+    else
+        printf("no throws");
+    printf(", depth %d%s\n", benchDepth, benchPin ? ", pinned" : "");
+#ifdef  EXCEPT_MUTEX_STATS
+    printf("%8s %14s %14s %8s %8s %8s %10s %10s\n", "threads", "calls/s",
+           "calls/s/thread", "p50 ns", "p99 ns", "p999 ns", "contended",
+           "wait ms");
+#else
+    printf("%8s %14s %14s %8s %8s %8s\n", "threads", "calls/s",
+           "calls/s/thread", "p50 ns", "p99 ns", "p999 ns");
+#endif
+
+    for (numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+    {
+        double          start;
+        double          seconds;
+        double          rate;
+        unsigned long   calls = 0;
+        MutexStats      before;
+        MutexStats      after;
+
+        memset(workers, 0, maxThreads * sizeof(Worker));
+        memset(latency, 0, LATENCY_BUCKETS * sizeof(unsigned long));
+        benchStop = 0;
+
+        ExceptGetMutexStats(&before);
+        start = now();
+        for (i = 0; i < numThreads; i++)
+        {
+            workers[i].index = i;
+            pthread_create(&workers[i].thread, NULL, bench, &workers[i]);
+        }
+        usleep(benchMs * 1000);
+        benchStop = 1;
+        for (i = 0; i < numThreads; i++)
+            pthread_join(workers[i].thread, NULL);
+        seconds = now() - start;
+        ExceptGetMutexStats(&after);
+
+        for (i = 0; i < numThreads; i++)
+        {
+            calls += workers[i].calls;
+            for (j = 0; j < LATENCY_BUCKETS; j++)
+                latency[j] += workers[i].latency[j];
+        }
+        rate = calls / seconds;
+
+#ifdef  EXCEPT_MUTEX_STATS
+        printf("%8d %14.0f %14.0f %8lu %8lu %8lu %10lu %10.3f\n", numThreads,
+               rate, rate / numThreads, percentile(latency, calls, 0.5),
+               percentile(latency, calls, 0.99),
+               percentile(latency, calls, 0.999),
+               after.contended - before.contended,
+               (after.waitNs - before.waitNs) / 1e6);
+#else
+        printf("%8d %14.0f %14.0f %8lu %8lu %8lu\n", numThreads, rate,
+               rate / numThreads, percentile(latency, calls, 0.5),
+               percentile(latency, calls, 0.99),
+               percentile(latency, calls, 0.999));
+#endif
+    }
+
+    free(latency);
+    free(workers);
+
+    return 0;
+}